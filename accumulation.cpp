@@ -0,0 +1,197 @@
+#include "accumulation.h"
+#include <iostream>
+
+// Function to allocate a float texture that is read with texelFetch
+static void allocateTarget(GLuint texture, GLint internalFormat, GLenum format, int width, int height)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+AccumulationBuffer::AccumulationBuffer(int width, int height)
+    : width(width), height(height), render_width(width), render_height(height), current(0), frames(0), samples(0)
+{
+    glGenFramebuffers(ACCUMULATION_TARGETS, framebuffers);
+    glGenTextures(ACCUMULATION_TARGETS, textures);
+    glGenTextures(ACCUMULATION_TARGETS, moment_textures);
+    glGenTextures(ACCUMULATION_TARGETS, normal_depth_textures);
+    glGenTextures(ACCUMULATION_TARGETS, albedo_textures);
+    glGenBuffers(ACCUMULATION_TARGETS, counters);
+
+    allocateTextures();
+
+    const GLenum drawBuffers[4] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+    for (int i = 0; i < ACCUMULATION_TARGETS; i++)
+    {
+        glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counters[i]);
+        glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_READ);
+        fences[i] = 0;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, moment_textures[i], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, normal_depth_textures[i], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, albedo_textures[i], 0);
+        glDrawBuffers(4, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cerr << "ERROR::ACCUMULATION::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        }
+    }
+
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void AccumulationBuffer::allocateTextures()
+{
+    for (int i = 0; i < ACCUMULATION_TARGETS; i++)
+    {
+        allocateTarget(textures[i], GL_RGBA32F, GL_RGBA, width, height);
+        allocateTarget(moment_textures[i], GL_RG32F, GL_RG, width, height);
+        allocateTarget(normal_depth_textures[i], GL_RGBA32F, GL_RGBA, width, height);
+        allocateTarget(albedo_textures[i], GL_RGBA32F, GL_RGBA, width, height);
+    }
+}
+
+void AccumulationBuffer::resize(int newWidth, int newHeight)
+{
+    // New storage for the same textures keeps the framebuffer attachments valid
+    width = newWidth;
+    height = newHeight;
+    render_width = width;
+    render_height = height;
+    allocateTextures();
+    glBindTexture(GL_TEXTURE_2D, 0);
+    reset();
+}
+
+void AccumulationBuffer::destroy()
+{
+    dropCounts();
+    glDeleteBuffers(ACCUMULATION_TARGETS, counters);
+    glDeleteFramebuffers(ACCUMULATION_TARGETS, framebuffers);
+    glDeleteTextures(ACCUMULATION_TARGETS, textures);
+    glDeleteTextures(ACCUMULATION_TARGETS, moment_textures);
+    glDeleteTextures(ACCUMULATION_TARGETS, normal_depth_textures);
+    glDeleteTextures(ACCUMULATION_TARGETS, albedo_textures);
+}
+
+void AccumulationBuffer::reset()
+{
+    frames = 0;
+    samples = 0;
+    dropCounts();
+}
+
+void AccumulationBuffer::dropCounts()
+{
+    for (int i = 0; i < ACCUMULATION_TARGETS; i++)
+    {
+        if (fences[i])
+        {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+    }
+}
+
+bool AccumulationBuffer::tracedPixels(GLuint& count)
+{
+    // Newest first, older frames only answer while the newer ones are in flight
+    for (int age = 0; age < ACCUMULATION_TARGETS; age++)
+    {
+        int target = (current + ACCUMULATION_TARGETS - age) % ACCUMULATION_TARGETS;
+        if (!fences[target])
+            continue;
+        GLenum status = glClientWaitSync(fences[target], 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            continue;
+
+        glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counters[target]);
+        glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &count);
+        glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+        return true;
+    }
+    return false;
+}
+
+void AccumulationBuffer::setRenderSize(int width, int height)
+{
+    render_width = width;
+    render_height = height;
+}
+
+void AccumulationBuffer::bindTarget(int target, GLuint textureUnit) const
+{
+    glActiveTexture(GL_TEXTURE0 + textureUnit);
+    glBindTexture(GL_TEXTURE_2D, textures[target]);
+    glActiveTexture(GL_TEXTURE0 + textureUnit + 1);
+    glBindTexture(GL_TEXTURE_2D, moment_textures[target]);
+    glActiveTexture(GL_TEXTURE0 + textureUnit + 2);
+    glBindTexture(GL_TEXTURE_2D, normal_depth_textures[target]);
+    glActiveTexture(GL_TEXTURE0 + textureUnit + 3);
+    glBindTexture(GL_TEXTURE_2D, albedo_textures[target]);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void AccumulationBuffer::begin(GLuint textureUnit)
+{
+    int target = (current + 1) % ACCUMULATION_TARGETS;
+    if (fences[target])
+    {
+        glDeleteSync(fences[target]);
+        fences[target] = 0;
+    }
+    const GLuint zero = 0;
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counters[target]);
+    glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &zero);
+    glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, TRACED_PIXELS_BINDING, counters[target]);
+
+    bindTarget(current, textureUnit);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[target]);
+    glViewport(0, 0, render_width, render_height);
+}
+
+void AccumulationBuffer::end(int samplesPerPixel)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    current = (current + 1) % ACCUMULATION_TARGETS;
+    frames++;
+    samples += static_cast<unsigned int>(samplesPerPixel);
+
+    // The atomic writes must land before the count is read back
+    glMemoryBarrier(GL_ATOMIC_COUNTER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void AccumulationBuffer::beginReprojection(GLuint textureUnit)
+{
+    // Counts from before the reprojection say nothing about the new view
+    dropCounts();
+
+    // The target before the latest one still holds the average it was blended from
+    bindTarget((current + ACCUMULATION_TARGETS - 1) % ACCUMULATION_TARGETS, textureUnit);
+    bindTarget(current, textureUnit + 4);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[(current + 1) % ACCUMULATION_TARGETS]);
+    glViewport(0, 0, render_width, render_height);
+}
+
+void AccumulationBuffer::endReprojection()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    current = (current + 1) % ACCUMULATION_TARGETS;
+}
+
+void AccumulationBuffer::present(int windowWidth, int windowHeight) const
+{
+    // Lower resolutions are upscaled with bilinear filtering
+    GLenum filter = render_width == windowWidth && render_height == windowHeight ? GL_NEAREST : GL_LINEAR;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[current]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, filter);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
@@ -0,0 +1,105 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include <GL/glew.h>
+
+// Number of render targets the frames rotate through. A moving camera needs the
+// average from before the latest frame while that frame is reprojected onto it.
+#define ACCUMULATION_TARGETS 3
+
+// Atomic counter binding the trace shader counts its traced pixels at
+#define TRACED_PIXELS_BINDING 0
+
+// Float render targets the frames are averaged in. Each frame reads the running
+// average from one target and writes the updated average into the next. A
+// second attachment carries each pixel's sample statistics for adaptive
+// sampling, and two more the averaged first-hit features the denoiser is guided by.
+class AccumulationBuffer
+{
+public:
+    AccumulationBuffer(int width, int height);
+
+    AccumulationBuffer(const AccumulationBuffer&) = delete;
+    AccumulationBuffer& operator=(const AccumulationBuffer&) = delete;
+
+    // Function to delete the GL objects, must run while the context is still alive
+    void destroy();
+
+    // Function to throw away the running average, the next frame starts over
+    void reset();
+
+    // Function to reallocate the targets for a new window size. The average is
+    // thrown away and the render size becomes the full size.
+    void resize(int width, int height);
+
+    // Function to render into the lower left width x height pixels only, for
+    // frames at a lower resolution. present() stretches them over the window.
+    void setRenderSize(int width, int height);
+    int renderWidth() const { return render_width; }
+    int renderHeight() const { return render_height; }
+
+    // Function to bind the write target, and the previous average, sample
+    // statistics, normal and depth, and albedo on the given texture unit and the
+    // three after it. The frame's traced pixel counter starts at zero.
+    void begin(GLuint textureUnit);
+
+    // Function to finish the frame, which handed every pixel samplesPerPixel
+    // samples, and move on to the next target
+    void end(int samplesPerPixel);
+
+    // Function to get how many pixels traced in the newest frame the GPU has
+    // finished, without waiting for it. False if no frame since the last reset
+    // or reprojection has finished yet.
+    bool tracedPixels(GLuint& count);
+
+    // Function to bind the write target, the average from before the latest
+    // frame on the given texture unit and the three after it, and the latest
+    // frame on the four units after those
+    void beginReprojection(GLuint textureUnit);
+
+    // Function to finish the reprojection, it does not count as a frame
+    void endReprojection();
+
+    // Function to copy the current average to the default framebuffer
+    void present(int windowWidth, int windowHeight) const;
+
+    // Number of frames blended into the current average
+    int frameCount() const { return frames; }
+
+    // Samples per pixel handed out since the last reset, whatever each frame took.
+    // Reprojection keeps counting, so the sequence index never repeats.
+    unsigned int sampleCount() const { return samples; }
+
+    // Textures holding the latest average and what goes with it
+    GLuint averageTexture() const { return textures[current]; }
+    GLuint momentTexture() const { return moment_textures[current]; }
+    GLuint normalDepthTexture() const { return normal_depth_textures[current]; }
+    GLuint albedoTexture() const { return albedo_textures[current]; }
+
+private:
+    // Function to size the textures of every target to width x height
+    void allocateTextures();
+
+    // Function to bind the four textures of a target on four texture units
+    void bindTarget(int target, GLuint textureUnit) const;
+
+    // Function to forget the traced pixel counts of the frames drawn so far
+    void dropCounts();
+
+    GLuint framebuffers[ACCUMULATION_TARGETS];
+    GLuint textures[ACCUMULATION_TARGETS];
+    GLuint moment_textures[ACCUMULATION_TARGETS]; // mean squared luminance and sample count per pixel
+    GLuint normal_depth_textures[ACCUMULATION_TARGETS]; // first-hit normal in rgb, its distance in a
+    GLuint albedo_textures[ACCUMULATION_TARGETS];
+    GLuint counters[ACCUMULATION_TARGETS]; // traced pixels of the frame written to each target
+    GLsync fences[ACCUMULATION_TARGETS];   // signals when that frame is done, 0 if not counted
+    int width;
+    int height;
+    int render_width;
+    int render_height;
+    int current; // index of the target holding the latest average
+    int frames;
+    unsigned int samples;
+};
+
+#endif // ACCUMULATION_H
@@ -0,0 +1,375 @@
+// Benchmark for the CPU tracer kernels. Every kernel runs a number of timed
+// batches, and the JSON report gives throughput and per-ray percentiles over
+// those batches. For the path and frame kernels a ray is one camera sample,
+// including all of its bounces.
+
+#include "bvh.h"
+#include "cpu_tracer.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sphere_soa.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using glm::vec3;
+
+struct BenchOptions
+{
+    int batches = 30;
+    double batch_ms = 20.0; // target length of one batch
+    unsigned int threads = 0;
+    bool quick = false;
+    SimdLevel simd = detectSimdLevel();
+    string output; // empty = stdout
+};
+
+struct BenchResult
+{
+    string name;
+    string kernel;
+    string simd;
+    int spheres;
+    bool bvh;
+    int bounces;
+    int rr_min_depth; // equal to bounces when Russian roulette is off
+    bool nee;
+    long long rays_per_batch;
+    vector<double> ns_per_ray; // one entry per batch, sorted
+};
+
+// Keeps results alive so the compiler cannot drop the work
+static volatile float sink;
+
+static double nowNs()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+    double position = p * (sorted.size() - 1);
+    size_t lower = size_t(position);
+    size_t upper = std::min(lower + 1, sorted.size() - 1);
+    return sorted[lower] + (sorted[upper] - sorted[lower]) * (position - lower);
+}
+
+// Function to run batches of work(rayCount) and time each one. The batch size
+// is calibrated first so a batch takes about options.batch_ms.
+template <typename Work>
+static vector<double> measure(const BenchOptions& options, long long& raysPerBatch, Work work)
+{
+    raysPerBatch = 1;
+    while (true)
+    {
+        double start = nowNs();
+        work(raysPerBatch);
+        double elapsedMs = (nowNs() - start) / 1e6;
+        if (elapsedMs >= options.batch_ms / 4 || raysPerBatch >= (1LL << 30))
+        {
+            raysPerBatch = std::max(1LL, (long long)(raysPerBatch * options.batch_ms / std::max(elapsedMs, 1e-3)));
+            break;
+        }
+        raysPerBatch *= 4;
+    }
+
+    vector<double> samples;
+    samples.reserve(options.batches);
+    for (int i = 0; i < options.batches; i++)
+    {
+        double start = nowNs();
+        work(raysPerBatch);
+        samples.push_back((nowNs() - start) / double(raysPerBatch));
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples;
+}
+
+// Function to make camera rays through random pixels, the same fan the window shows
+static vector<Ray> makeRays(int count, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    Camera camera = cameraSetup();
+    float halfHeight = camera.viewport_height / 2;
+    float halfWidth = halfHeight * 4.0f / 3.0f;
+
+    vector<Ray> rays(count);
+    for (Ray& ray : rays)
+    {
+        ray.origin = camera.camera_center;
+        ray.dir = glm::normalize(vec3(unit(rng) * halfWidth, unit(rng) * halfHeight, -camera.focal_length));
+    }
+    return rays;
+}
+
+static BenchResult benchIntersection(const BenchOptions& options, const vector<Ray>& rays)
+{
+    vector<Sphere> spheres = spheresSetup();
+    BenchResult result = { "intersect_sphere", "intersect", "scalar", 4, false, 0, 0, false, 0, {} };
+
+    result.ns_per_ray = measure(options, result.rays_per_batch, [&](long long count)
+    {
+        float total = 0.0f;
+        for (long long i = 0; i < count; i++)
+            total += intersectSphere(rays[i % rays.size()], spheres[i & 3]);
+        sink = total;
+    });
+    return result;
+}
+
+static BenchResult benchClosestHit(const BenchOptions& options, const vector<Ray>& rays, int numSpheres, bool useBvh, ThreadPool& pool)
+{
+    vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, numSpheres - static_cast<int>(spheres.size()), 1234);
+    Bvh bvh;
+    if (useBvh)
+        bvh.build(spheres.data(), static_cast<int>(spheres.size()));
+    CpuTracer tracer(spheres.data(), static_cast<int>(spheres.size()), useBvh ? &bvh : nullptr, pool);
+
+    BenchResult result = { string("closest_hit_") + (useBvh ? "bvh_" : "linear_") + std::to_string(numSpheres) + "_" + simdLevelName(getSimdLevel()),
+        "closest_hit", simdLevelName(getSimdLevel()), numSpheres, useBvh, 0, 0, false, 0, {} };
+
+    result.ns_per_ray = measure(options, result.rays_per_batch, [&](long long count)
+    {
+        float total = 0.0f;
+        for (long long i = 0; i < count; i++)
+            total += tracer.calcRayCollision(rays[i % rays.size()]).dst;
+        sink = total;
+    });
+    return result;
+}
+
+// Same rays and scenes as benchClosestHit, so the two can be compared directly
+static BenchResult benchOccluded(const BenchOptions& options, const vector<Ray>& rays, int numSpheres, bool useBvh, ThreadPool& pool)
+{
+    vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, numSpheres - static_cast<int>(spheres.size()), 1234);
+    Bvh bvh;
+    if (useBvh)
+        bvh.build(spheres.data(), static_cast<int>(spheres.size()));
+    CpuTracer tracer(spheres.data(), static_cast<int>(spheres.size()), useBvh ? &bvh : nullptr, pool);
+
+    BenchResult result = { string("occluded_") + (useBvh ? "bvh_" : "linear_") + std::to_string(numSpheres) + "_" + simdLevelName(getSimdLevel()),
+        "occluded", simdLevelName(getSimdLevel()), numSpheres, useBvh, 0, 0, false, 0, {} };
+
+    result.ns_per_ray = measure(options, result.rays_per_batch, [&](long long count)
+    {
+        int total = 0;
+        for (long long i = 0; i < count; i++)
+            total += tracer.occluded(rays[i % rays.size()], NO_HIT) ? 1 : 0;
+        sink = float(total);
+    });
+    return result;
+}
+
+static BenchResult benchTrace(const BenchOptions& options, const vector<Ray>& rays, int numSpheres, int bounces, int rrMinDepth, bool nextEvent, ThreadPool& pool)
+{
+    vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, numSpheres - static_cast<int>(spheres.size()), 1234);
+    Bvh bvh;
+    bvh.build(spheres.data(), static_cast<int>(spheres.size()));
+    CpuTracer tracer(spheres.data(), static_cast<int>(spheres.size()), &bvh, pool);
+
+    string name = "trace_" + std::to_string(numSpheres) + "_bounce_" + std::to_string(bounces);
+    if (rrMinDepth < bounces)
+        name += "_rr" + std::to_string(rrMinDepth);
+    if (nextEvent)
+        name += "_nee";
+    BenchResult result = { name, "trace", simdLevelName(getSimdLevel()), numSpheres, true, bounces, rrMinDepth, nextEvent, 0, {} };
+
+    result.ns_per_ray = measure(options, result.rays_per_batch, [&](long long count)
+    {
+        vec3 total = vec3(0.0f);
+        for (long long i = 0; i < count; i++)
+        {
+            Sampler sampler = makeSampler(SamplerType::Sobol, uint32_t(i % 640), uint32_t(i / 640 % 480), 0, uint32_t(i), 0);
+            total += tracer.trace(rays[i % rays.size()], sampler, bounces, rrMinDepth, nextEvent);
+        }
+        sink = total.x + total.y + total.z;
+    });
+    return result;
+}
+
+static BenchResult benchFrame(const BenchOptions& options, int numSpheres, int width, int height, int spp, ThreadPool& pool)
+{
+    vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, numSpheres - static_cast<int>(spheres.size()), 1234);
+    Bvh bvh;
+    bvh.build(spheres.data(), static_cast<int>(spheres.size()));
+    CpuTracer tracer(spheres.data(), static_cast<int>(spheres.size()), &bvh, pool);
+    Camera camera = cameraSetup();
+
+    RenderSettings settings;
+    settings.width = width;
+    settings.height = height;
+    settings.rays_per_pixel = spp;
+    settings.max_bounce = 8;
+    settings.rr_min_depth = 3;
+    settings.next_event = true;
+    settings.frame_index = 0;
+    settings.sampler = SamplerType::Sobol;
+
+    BenchResult result = { "frame_" + std::to_string(width) + "x" + std::to_string(height) + "_" + std::to_string(spp) + "spp",
+        "frame", simdLevelName(getSimdLevel()), numSpheres, true, settings.max_bounce, settings.rr_min_depth, settings.next_event, 0, {} };
+
+    // Whole frames only, so every batch is one frame
+    vector<vec3> image;
+    long long raysPerFrame = (long long)width * height * spp;
+    for (int i = 0; i < options.batches; i++)
+    {
+        settings.frame_index = i;
+        double start = nowNs();
+        tracer.render(camera, settings, image);
+        result.ns_per_ray.push_back((nowNs() - start) / double(raysPerFrame));
+    }
+    std::sort(result.ns_per_ray.begin(), result.ns_per_ray.end());
+    result.rays_per_batch = raysPerFrame;
+    return result;
+}
+
+static void writeJson(std::ostream& out, const BenchOptions& options, unsigned int threads, const vector<BenchResult>& results)
+{
+    out << "{\n  \"threads\": " << threads << ",\n  \"batches\": " << options.batches << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        double median = percentile(r.ns_per_ray, 0.5);
+        double mean = 0.0;
+        for (double ns : r.ns_per_ray)
+            mean += ns;
+        mean /= r.ns_per_ray.size();
+
+        out << "    {\"name\": \"" << r.name << "\", \"kernel\": \"" << r.kernel << "\", \"simd\": \"" << r.simd << "\", \"spheres\": " << r.spheres
+            << ", \"bvh\": " << (r.bvh ? "true" : "false") << ", \"bounces\": " << r.bounces << ", \"rr_min_depth\": " << r.rr_min_depth
+            << ", \"nee\": " << (r.nee ? "true" : "false")
+            << ", \"rays_per_batch\": " << r.rays_per_batch
+            << ", \"mrays_per_s\": " << 1e3 / median
+            << ", \"ns_per_ray\": {\"mean\": " << mean << ", \"min\": " << r.ns_per_ray.front()
+            << ", \"p50\": " << median << ", \"p90\": " << percentile(r.ns_per_ray, 0.9)
+            << ", \"p99\": " << percentile(r.ns_per_ray, 0.99) << ", \"max\": " << r.ns_per_ray.back() << "}}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (std::strcmp(arg, "--quick") == 0)
+            options.quick = true;
+        else if (std::strcmp(arg, "--batches") == 0 && hasValue)
+            options.batches = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--batch-ms") == 0 && hasValue)
+            options.batch_ms = std::atof(argv[++i]);
+        else if (std::strcmp(arg, "--threads") == 0 && hasValue)
+        {
+            // 0 = every core, negative counts would wrap to billions of threads
+            int threads = std::atoi(argv[++i]);
+            if (threads < 0)
+            {
+                std::cerr << "Thread count must not be negative" << std::endl;
+                return false;
+            }
+            options.threads = static_cast<unsigned int>(threads);
+        }
+        else if (std::strcmp(arg, "--simd") == 0 && hasValue)
+        {
+            if (!parseSimdLevel(argv[++i], options.simd))
+            {
+                std::cerr << "Unknown SIMD level: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (std::strcmp(arg, "--out") == 0 && hasValue)
+            options.output = argv[++i];
+        else
+        {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return options.batches > 0 && options.batch_ms > 0.0;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--quick] [--batches N] [--batch-ms MS] [--threads N] [--simd LEVEL] [--out FILE]" << std::endl;
+        return -1;
+    }
+    if (options.quick)
+    {
+        options.batches = std::min(options.batches, 5);
+        options.batch_ms = std::min(options.batch_ms, 5.0);
+    }
+
+    ThreadPool pool(options.threads);
+    vector<Ray> rays = makeRays(1 << 16, 42);
+    vector<BenchResult> results;
+
+    std::cerr << "Running benchmarks on " << pool.size() << " threads" << std::endl;
+    results.push_back(benchIntersection(options, rays));
+
+    // Every supported kernel on the same scenes, to compare the instruction sets
+    SimdLevel best = setSimdLevel(options.simd);
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (level > best)
+            break;
+        setSimdLevel(level);
+        results.push_back(benchClosestHit(options, rays, 1024, false, pool));
+        results.push_back(benchClosestHit(options, rays, 16384, true, pool));
+    }
+    setSimdLevel(best);
+
+    vector<int> linearCounts = options.quick ? vector<int>{ 4, 256 } : vector<int>{ 4, 64, 16384 };
+    vector<int> bvhCounts = options.quick ? vector<int>{ 4, 256 } : vector<int>{ 4, 64, 1024, 262144 };
+    for (int count : linearCounts)
+        results.push_back(benchClosestHit(options, rays, count, false, pool));
+    for (int count : bvhCounts)
+        results.push_back(benchClosestHit(options, rays, count, true, pool));
+    results.push_back(benchOccluded(options, rays, 1024, false, pool));
+    results.push_back(benchOccluded(options, rays, 16384, true, pool));
+
+    for (int bounces : { 1, 3, 8 })
+        results.push_back(benchTrace(options, rays, 1024, bounces, bounces, false, pool));
+    results.push_back(benchTrace(options, rays, 1024, 8, 3, false, pool));
+    results.push_back(benchTrace(options, rays, 1024, 8, 3, true, pool));
+
+    if (options.quick)
+        results.push_back(benchFrame(options, 1024, 160, 120, 1, pool));
+    else
+        results.push_back(benchFrame(options, 1024, 640, 480, 4, pool));
+
+    if (options.output.empty())
+    {
+        writeJson(std::cout, options, pool.size(), results);
+        return 0;
+    }
+
+    std::ofstream file(options.output);
+    writeJson(file, options, pool.size(), results);
+    if (!file)
+    {
+        std::cerr << "Failed to write " << options.output << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,438 @@
+#include "bvh.h"
+#include <algorithm>
+#include <chrono>
+
+using glm::vec3;
+
+#define BVH_BINS 16
+
+static_assert(BVH_MAX_LEAF_SIZE < (1 << GPU_LEAF_COUNT_BITS), "leaf size must fit the packed sphere range");
+
+struct Bounds
+{
+    vec3 min = vec3(1e30f);
+    vec3 max = vec3(-1e30f);
+
+    void grow(vec3 point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void grow(const Bounds& other)
+    {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+
+    float area() const
+    {
+        vec3 e = max - min;
+        return e.x < 0.0f ? 0.0f : e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+static Bounds sphereBounds(const Sphere& sphere)
+{
+    Bounds bounds;
+    bounds.min = sphere.center - vec3(sphere.radius);
+    bounds.max = sphere.center + vec3(sphere.radius);
+    return bounds;
+}
+
+void Bvh::build(Sphere* spheres, int numSpheres)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    node_data = nullptr;
+    node_count = 0;
+    stats = {};
+    if (numSpheres <= 0)
+        return;
+    nodes.reserve(size_t(numSpheres) * 2);
+
+    struct BuildTask
+    {
+        int node;
+        int first;
+        int count;
+        int depth;
+    };
+    std::vector<BuildTask> tasks;
+
+    nodes.push_back(BvhNode());
+    tasks.push_back({ 0, 0, numSpheres, 1 });
+
+    while (!tasks.empty())
+    {
+        BuildTask task = tasks.back();
+        tasks.pop_back();
+        stats.max_depth = std::max(stats.max_depth, task.depth);
+
+        Bounds bounds, centroidBounds;
+        for (int i = task.first; i < task.first + task.count; i++)
+        {
+            bounds.grow(sphereBounds(spheres[i]));
+            centroidBounds.grow(spheres[i].center);
+        }
+
+        BvhNode& node = nodes[task.node];
+        node.bounds_min = bounds.min;
+        node.bounds_max = bounds.max;
+        node.left_first = task.first;
+        node.count = task.count;
+
+        if (task.count <= 2)
+        {
+            stats.leaf_count++;
+            continue;
+        }
+
+        // Find the cheapest split plane over all axes with binned SAH
+        int bestAxis = -1;
+        int bestSplit = 0;
+        float bestCost = 1e30f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float axisMin = centroidBounds.min[axis];
+            float extent = centroidBounds.max[axis] - axisMin;
+            if (extent <= 0.0f)
+                continue;
+
+            Bounds binBounds[BVH_BINS];
+            int binCount[BVH_BINS] = {};
+            float scale = BVH_BINS / extent;
+            for (int i = task.first; i < task.first + task.count; i++)
+            {
+                int bin = std::min(BVH_BINS - 1, int((spheres[i].center[axis] - axisMin) * scale));
+                binCount[bin]++;
+                binBounds[bin].grow(sphereBounds(spheres[i]));
+            }
+
+            // Sweep from both sides to get the cost of every split between bins
+            float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+            int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+            Bounds leftBox, rightBox;
+            int leftSum = 0, rightSum = 0;
+            for (int i = 0; i < BVH_BINS - 1; i++)
+            {
+                leftSum += binCount[i];
+                leftCount[i] = leftSum;
+                leftBox.grow(binBounds[i]);
+                leftArea[i] = leftBox.area();
+
+                rightSum += binCount[BVH_BINS - 1 - i];
+                rightCount[BVH_BINS - 2 - i] = rightSum;
+                rightBox.grow(binBounds[BVH_BINS - 1 - i]);
+                rightArea[BVH_BINS - 2 - i] = rightBox.area();
+            }
+
+            for (int i = 0; i < BVH_BINS - 1; i++)
+            {
+                float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (leftCount[i] > 0 && rightCount[i] > 0 && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        // Traversal and intersection both cost 1, so the leaf costs count * area
+        float leafCost = task.count * bounds.area();
+        float splitCost = bounds.area() + bestCost;
+        if (task.count <= BVH_MAX_LEAF_SIZE && (bestAxis < 0 || splitCost >= leafCost))
+        {
+            stats.leaf_count++;
+            continue;
+        }
+
+        int leftCount;
+        if (bestAxis >= 0 && task.depth < BVH_STACK_SIZE / 2)
+        {
+            float axisMin = centroidBounds.min[bestAxis];
+            float scale = BVH_BINS / (centroidBounds.max[bestAxis] - axisMin);
+            Sphere* middle = std::partition(spheres + task.first, spheres + task.first + task.count,
+                [&](const Sphere& sphere)
+                {
+                    int bin = std::min(BVH_BINS - 1, int((sphere.center[bestAxis] - axisMin) * scale));
+                    return bin <= bestSplit;
+                });
+            leftCount = int(middle - (spheres + task.first));
+        }
+        else
+        {
+            // Coincident centroids or a very deep tree: split at the object median
+            // on the widest axis. Halving keeps the depth within the traversal stack.
+            vec3 extent = centroidBounds.max - centroidBounds.min;
+            int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+            leftCount = task.count / 2;
+            std::nth_element(spheres + task.first, spheres + task.first + leftCount, spheres + task.first + task.count,
+                [axis](const Sphere& a, const Sphere& b) { return a.center[axis] < b.center[axis]; });
+        }
+
+        int left = static_cast<int>(nodes.size());
+        nodes.push_back(BvhNode());
+        nodes.push_back(BvhNode());
+
+        // node may have moved when the vector grew
+        nodes[task.node].left_first = left;
+        nodes[task.node].count = 0;
+
+        tasks.push_back({ left + 1, task.first + leftCount, task.count - leftCount, task.depth + 1 });
+        tasks.push_back({ left, task.first, leftCount, task.depth + 1 });
+    }
+
+    stats.node_count = static_cast<int>(nodes.size());
+    stats.node_bytes = nodes.size() * sizeof(BvhNode);
+    node_data = nodes.data();
+    node_count = static_cast<int>(nodes.size());
+    stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Bvh::attach(const BvhNode* nodeData, int nodeCount)
+{
+    nodes.clear();
+    node_data = nodeCount > 0 ? nodeData : nullptr;
+    node_count = nodeCount > 0 ? nodeCount : 0;
+
+    stats = {};
+    stats.node_count = node_count;
+    stats.node_bytes = size_t(node_count) * sizeof(BvhNode);
+
+    // Children are always stored after their parent, so one forward pass finds every depth
+    std::vector<int> depth(node_count, 1);
+    for (int i = 0; i < node_count; i++)
+    {
+        stats.max_depth = std::max(stats.max_depth, depth[i]);
+        if (node_data[i].count > 0)
+        {
+            stats.leaf_count++;
+            continue;
+        }
+        depth[node_data[i].left_first] = depth[i] + 1;
+        depth[node_data[i].left_first + 1] = depth[i] + 1;
+    }
+}
+
+std::vector<GpuBvhNode> Bvh::flatten() const
+{
+    std::vector<GpuBvhNode> flat;
+    if (node_count == 0)
+        return flat;
+
+    // Children are always stored after their parent, so one backwards pass sizes every subtree
+    std::vector<int> subtreeSize(node_count, 1);
+    for (int i = node_count - 1; i >= 0; i--)
+    {
+        if (node_data[i].count == 0)
+            subtreeSize[i] += subtreeSize[node_data[i].left_first] + subtreeSize[node_data[i].left_first + 1];
+    }
+
+    flat.reserve(node_count);
+    std::vector<int> pending = { 0 };
+    while (!pending.empty())
+    {
+        const BvhNode& node = node_data[pending.back()];
+        int index = static_cast<int>(flat.size());
+        int miss = index + subtreeSize[pending.back()];
+        pending.pop_back();
+
+        GpuBvhNode gpuNode;
+        gpuNode.bounds_min = node.bounds_min;
+        gpuNode.bounds_max = node.bounds_max;
+        gpuNode.miss_index = miss < node_count ? miss : -1;
+        gpuNode.sphere_range = node.count > 0 ? (node.left_first << GPU_LEAF_COUNT_BITS) | node.count : 0;
+        flat.push_back(gpuNode);
+
+        // Left child comes out next, right child after the left subtree
+        if (node.count == 0)
+        {
+            pending.push_back(node.left_first + 1);
+            pending.push_back(node.left_first);
+        }
+    }
+    return flat;
+}
+
+// Function to get the entry distance of the ray into a node, NO_HIT if it misses
+// or if the box starts beyond maxDst
+static float intersectBounds(const BvhNode& node, vec3 origin, vec3 invDir, float maxDst)
+{
+    vec3 t0 = (node.bounds_min - origin) * invDir;
+    vec3 t1 = (node.bounds_max - origin) * invDir;
+    vec3 tNear = glm::min(t0, t1);
+    vec3 tFar = glm::max(t0, t1);
+    float entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDst));
+    return entry <= exit ? entry : NO_HIT;
+}
+
+// Function to walk the tree nearer child first. testLeaf(first, count, dst) returns
+// the closest sphere of a leaf and lowers dst, or -1.
+template <typename LeafTest>
+static int walkClosest(const BvhNode* nodes, int nodeCount, const Ray& ray, float& dst, LeafTest testLeaf)
+{
+    // NaN or zero directions cannot hit anything, and NaN would slip through the slab test
+    if (nodeCount == 0 || !(glm::dot(ray.dir, ray.dir) > 0.0f))
+        return -1;
+
+    vec3 invDir = 1.0f / ray.dir;
+    int closest = -1;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int current = 0;
+
+    if (intersectBounds(nodes[0], ray.origin, invDir, dst) == NO_HIT)
+        return -1;
+
+    while (true)
+    {
+        const BvhNode& node = nodes[current];
+        if (node.count > 0)
+        {
+            int hit = testLeaf(node.left_first, node.count, dst);
+            if (hit >= 0)
+                closest = hit;
+        }
+        else
+        {
+            // Visit the nearer child first, push the other one for later
+            int left = node.left_first;
+            float leftDst = intersectBounds(nodes[left], ray.origin, invDir, dst);
+            float rightDst = intersectBounds(nodes[left + 1], ray.origin, invDir, dst);
+            int nearChild = left, farChild = left + 1;
+            if (rightDst < leftDst)
+            {
+                std::swap(leftDst, rightDst);
+                std::swap(nearChild, farChild);
+            }
+
+            if (leftDst != NO_HIT)
+            {
+                if (rightDst != NO_HIT)
+                    stack[stackSize++] = farChild;
+                current = nearChild;
+                continue;
+            }
+        }
+
+        // Pop until a node is found that can still hold a closer hit
+        bool found = false;
+        while (stackSize > 0)
+        {
+            current = stack[--stackSize];
+            if (intersectBounds(nodes[current], ray.origin, invDir, dst) != NO_HIT)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            return closest;
+    }
+}
+
+// Function to walk the tree until testLeaf(first, count) reports a hit. Any hit
+// will do, but the nearer child still goes first: near spheres are the likely
+// blockers, so the walk tends to stop sooner.
+template <typename LeafTest>
+static bool walkAny(const BvhNode* nodes, int nodeCount, const Ray& ray, float maxDst, LeafTest testLeaf)
+{
+    if (nodeCount == 0 || !(glm::dot(ray.dir, ray.dir) > 0.0f))
+        return false;
+
+    vec3 invDir = 1.0f / ray.dir;
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int current = 0;
+
+    if (intersectBounds(nodes[0], ray.origin, invDir, maxDst) == NO_HIT)
+        return false;
+
+    while (true)
+    {
+        const BvhNode& node = nodes[current];
+        if (node.count > 0)
+        {
+            if (testLeaf(node.left_first, node.count))
+                return true;
+        }
+        else
+        {
+            int left = node.left_first;
+            float leftDst = intersectBounds(nodes[left], ray.origin, invDir, maxDst);
+            float rightDst = intersectBounds(nodes[left + 1], ray.origin, invDir, maxDst);
+            int nearChild = left, farChild = left + 1;
+            if (rightDst < leftDst)
+            {
+                std::swap(leftDst, rightDst);
+                std::swap(nearChild, farChild);
+            }
+
+            if (leftDst != NO_HIT)
+            {
+                if (rightDst != NO_HIT)
+                    stack[stackSize++] = farChild;
+                current = nearChild;
+                continue;
+            }
+        }
+
+        // maxDst never shrinks, so popped nodes need no second bounds test
+        if (stackSize == 0)
+            return false;
+        current = stack[--stackSize];
+    }
+}
+
+int Bvh::closestHit(const Ray& ray, const Sphere* spheres, float& dst) const
+{
+    return walkClosest(node_data, node_count, ray, dst, [&](int first, int count, float& leafDst)
+    {
+        int closest = -1;
+        for (int i = first; i < first + count; i++)
+        {
+            float t = intersectSphere(ray, spheres[i]);
+            if (t < leafDst)
+            {
+                leafDst = t;
+                closest = i;
+            }
+        }
+        return closest;
+    });
+}
+
+int Bvh::closestHit(const Ray& ray, const SphereSoA& spheres, float& dst) const
+{
+    return walkClosest(node_data, node_count, ray, dst, [&](int first, int count, float& leafDst)
+    {
+        return spheres.closestHit(ray, first, count, leafDst);
+    });
+}
+
+bool Bvh::anyHit(const Ray& ray, const Sphere* spheres, float maxDst) const
+{
+    return walkAny(node_data, node_count, ray, maxDst, [&](int first, int count)
+    {
+        for (int i = first; i < first + count; i++)
+        {
+            if (intersectSphere(ray, spheres[i]) < maxDst)
+                return true;
+        }
+        return false;
+    });
+}
+
+bool Bvh::anyHit(const Ray& ray, const SphereSoA& spheres, float maxDst) const
+{
+    return walkAny(node_data, node_count, ray, maxDst, [&](int first, int count)
+    {
+        return spheres.anyHit(ray, first, count, maxDst);
+    });
+}
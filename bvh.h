@@ -0,0 +1,92 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "ray.h"
+#include "scene.h"
+#include "sphere_soa.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// Leaves never hold more than this many spheres
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+
+// Leaves of the flattened tree pack their sphere range as first << 4 | count
+#define GPU_LEAF_COUNT_BITS 4
+
+// 32-byte node. Children of an interior node are stored next to each other, and
+// leaves point at a contiguous range of spheres. The layout is also valid std430.
+struct BvhNode
+{
+    glm::vec3 bounds_min;
+    int left_first; // interior: index of the left child, leaf: index of the first sphere
+    glm::vec3 bounds_max;
+    int count;      // number of spheres, 0 for interior nodes
+};
+
+// Node of the flattened tree the shader walks without a stack. Nodes are stored
+// depth first, so an interior node's first child is the next node, and
+// miss_index points past the node's subtree (-1 after the last one).
+struct GpuBvhNode
+{
+    glm::vec3 bounds_min;
+    int miss_index;
+    glm::vec3 bounds_max;
+    int sphere_range; // 0 for interior nodes
+};
+
+struct BvhStats
+{
+    double build_ms;
+    size_t node_bytes;
+    int node_count;
+    int leaf_count;
+    int max_depth;
+};
+
+class Bvh
+{
+public:
+    Bvh() = default;
+
+    // The node view would point into the other tree
+    Bvh(const Bvh&) = delete;
+    Bvh& operator=(const Bvh&) = delete;
+
+    // Function to build the tree with binned SAH. The spheres are reordered in
+    // place so every leaf covers a contiguous range of the array.
+    void build(Sphere* spheres, int numSpheres);
+
+    // Function to use a tree stored elsewhere, e.g. in a mapped scene file. The
+    // nodes are not copied and must outlive the tree. They are trusted, scene
+    // files check theirs when they are opened.
+    void attach(const BvhNode* nodeData, int nodeCount);
+
+    // Function to find the closest sphere along the ray. Returns its index, or -1
+    // if nothing is closer than dst. dst is updated with the hit distance.
+    int closestHit(const Ray& ray, const Sphere* spheres, float& dst) const;
+
+    // Same as above, but leaves are tested with the SIMD kernel. The SoA copy must
+    // be in the order the tree was built over.
+    int closestHit(const Ray& ray, const SphereSoA& spheres, float& dst) const;
+
+    // Function to check whether any sphere is hit closer than maxDst, for shadow
+    // rays. Returns at the first hit found instead of looking for the closest.
+    bool anyHit(const Ray& ray, const Sphere* spheres, float maxDst) const;
+    bool anyHit(const Ray& ray, const SphereSoA& spheres, float maxDst) const;
+
+    // Function to lay the tree out depth first with miss links for the shader
+    std::vector<GpuBvhNode> flatten() const;
+
+    const BvhNode* getNodes() const { return node_data; }
+    int nodeCount() const { return node_count; }
+    const BvhStats& getStats() const { return stats; }
+
+private:
+    std::vector<BvhNode> nodes; // storage for trees built here
+    const BvhNode* node_data = nullptr;
+    int node_count = 0;
+    BvhStats stats = {};
+};
+
+#endif // BVH_H
@@ -0,0 +1,489 @@
+#include "cpu_tracer.h"
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+using std::vector;
+using glm::vec3;
+
+#define TILE_SIZE 16
+#define PI 3.141592653589793238f
+
+// Samples a pixel takes before its error estimate is trusted, and samples per
+// pixel in each pass of an adaptive render
+#define ADAPTIVE_MIN_SAMPLES 16
+#define ADAPTIVE_PASS_SAMPLES 8
+
+// Function to build an orthonormal basis around n without branching on its
+// direction (Duff et al. 2017)
+static void orthonormalBasis(vec3 n, vec3& tangent, vec3& bitangent)
+{
+    float s = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (s + n.z);
+    float b = n.x * n.y * a;
+    tangent = vec3(1.0f + s * n.x * n.x * a, s * b, -s * n.x);
+    bitangent = vec3(b, s + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction around the normal. The pdf cancels the cosine term
+// of a diffuse surface, so a bounce only multiplies the path by the albedo.
+static vec3 randomHemisphereDir(vec3 normal, glm::vec2 u)
+{
+    float r = std::sqrt(u.x);
+    float phi = 2.0f * PI * u.y;
+    vec3 tangent, bitangent;
+    orthonormalBasis(normal, tangent, bitangent);
+    return glm::normalize(tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(std::max(0.0f, 1.0f - u.x)));
+}
+
+static vec3 emitted(const Material& material)
+{
+    return material.emission_strength * material.emmision_color * 0.5f;
+}
+
+// Function to get 1 - cos of the half angle of the cone a light covers as seen
+// from point, 0 from inside it. Computed without the subtraction so small, far
+// away lights keep their precision.
+static float lightCone(vec3 point, const Sphere& light)
+{
+    vec3 toCenter = light.center - point;
+    float sin2 = light.radius * light.radius / glm::dot(toCenter, toCenter);
+    if (!(sin2 < 1.0f))
+        return 0.0f;
+    return sin2 / (1.0f + std::sqrt(1.0f - sin2));
+}
+
+// Power heuristic weight of one sampling strategy against the other
+static float misWeight(float pdf, float otherPdf)
+{
+    float pdf2 = pdf * pdf;
+    return pdf2 / (pdf2 + otherPdf * otherPdf);
+}
+
+static float luminance(vec3 color)
+{
+    return glm::dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Function to estimate how far a pixel's average still is from converging: the
+// standard error of its luminance over the square root of the luminance, which
+// roughly follows the noise left visible after gamma. Pixels with too few
+// samples to judge never count as converged.
+//
+// Samples that all agree show no variance, yet a detail covering less than about
+// 1/samples of the pixel may not have been hit (rule of three), e.g. the edge of
+// a light. It is no brighter than the neighbours, so range, the spread of their
+// luminance, bounds how much it would change the pixel.
+static float pixelError(vec3 mean, float meanSquare, int samples, float range)
+{
+    if (samples < ADAPTIVE_MIN_SAMPLES)
+        return std::numeric_limits<float>::max();
+    float lum = luminance(mean);
+    float variance = std::max(meanSquare - lum * lum, 0.0f);
+    float missed = range / float(samples);
+    return std::sqrt((variance / float(samples - 1) + missed * missed) / std::max(lum, 1e-4f));
+}
+
+// Function to get the luminance range of a pixel and its 8 neighbours
+static float neighbourRange(const vector<vec3>& image, int width, int height, int x, int row)
+{
+    float low = std::numeric_limits<float>::max();
+    float high = 0.0f;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int nx = std::min(std::max(x + dx, 0), width - 1);
+            int ny = std::min(std::max(row + dy, 0), height - 1);
+            float lum = luminance(image[size_t(ny) * width + nx]);
+            low = std::min(low, lum);
+            high = std::max(high, lum);
+        }
+    }
+    return high - low;
+}
+
+// Running sums of what the samples of one pixel recorded for the denoiser
+struct FeatureSums
+{
+    vec3 normal = vec3(0.0f);
+    float depth = 0.0f;
+    vec3 albedo = vec3(0.0f);
+    float square = 0.0f;
+
+    void add(const HitInfo& first, vec3 light)
+    {
+        if (first.hit)
+        {
+            normal += first.normal;
+            depth += first.dst;
+            albedo += first.material.color;
+        }
+        square += luminance(light) * luminance(light);
+    }
+};
+
+// Function to blend the averages of samples into a pixel's features, weight is
+// their share of all the pixel's samples
+static void blendFeatures(DenoiseFeatures& features, size_t pixel, const FeatureSums& sums, int samples, float weight)
+{
+    float count = float(samples);
+    features.normal[pixel] += (sums.normal / count - features.normal[pixel]) * weight;
+    features.depth[pixel] += (sums.depth / count - features.depth[pixel]) * weight;
+    features.albedo[pixel] += (sums.albedo / count - features.albedo[pixel]) * weight;
+    features.mean_square[pixel] += (sums.square / count - features.mean_square[pixel]) * weight;
+}
+
+static Ray ray_setup(const FrameUniforms& frame, int x, int y, glm::vec2 jitter)
+{
+    // jitter in [0, 1) spreads the samples over the pixel's area
+    vec3 pixel_sample = frame.pixel00_loc + ((float(x) + jitter.x - 0.5f) * frame.pixel_delta_u) + ((float(y) + jitter.y - 0.5f) * frame.pixel_delta_v);
+    vec3 ray_direction = glm::normalize(pixel_sample - frame.camera_center);
+
+    Ray ray;
+    ray.origin = frame.camera_center;
+    ray.dir = ray_direction;
+    return ray;
+}
+
+CpuTracer::CpuTracer(const Sphere* spheres, int numSpheres, const Bvh* bvh, ThreadPool& pool)
+    : spheres(spheres), numSpheres(numSpheres), bvh(bvh), pool(pool)
+{
+    sphereSoA.build(spheres, numSpheres);
+    lights = findLights(spheres, numSpheres);
+}
+
+HitInfo CpuTracer::calcRayCollision(const Ray& ray) const
+{
+    HitInfo closest;
+    closest.hit = false;
+    closest.dst = NO_HIT;
+    closest.index = -1;
+
+    int index;
+    if (bvh)
+        index = bvh->closestHit(ray, sphereSoA, closest.dst);
+    else
+        index = sphereSoA.closestHit(ray, 0, numSpheres, closest.dst);
+
+    // Only the closest hit pays for the point, normal and material
+    if (index >= 0)
+    {
+        const Sphere& sphere = spheres[index];
+        closest.hit = true;
+        closest.point = ray.origin + ray.dir * closest.dst;
+        closest.normal = (closest.point - sphere.center) / sphere.radius;
+        closest.material = sphere.material;
+        closest.index = index;
+    }
+    return closest;
+}
+
+bool CpuTracer::occluded(const Ray& ray, float maxDst) const
+{
+    if (bvh)
+        return bvh->anyHit(ray, sphereSoA, maxDst);
+    return sphereSoA.anyHit(ray, 0, numSpheres, maxDst);
+}
+
+// Solid angle density of sampleLight() picking this light and direction
+float CpuTracer::lightPdf(vec3 point, const Sphere& light) const
+{
+    float cone = lightCone(point, light);
+    return cone > 0.0f ? 1.0f / (float(lights.size()) * 2.0f * PI * cone) : 0.0f;
+}
+
+// Function to get the light reaching a diffuse point from one random light, per
+// unit of albedo. The direction is uniform in the cone the light covers, and the
+// result is weighted against the cosine bounce finding the same light.
+vec3 CpuTracer::sampleLight(vec3 point, vec3 normal, glm::vec2 u) const
+{
+    // u.x picks the light, the rest of it places the direction in the cone
+    int numLights = static_cast<int>(lights.size());
+    float pick = u.x * float(numLights);
+    int slot = std::min(int(pick), numLights - 1);
+    u.x = pick - float(slot);
+
+    int index = lights[slot];
+    const Sphere& light = spheres[index];
+    float cone = lightCone(point, light);
+    if (cone <= 0.0f)
+        return vec3(0, 0, 0);
+
+    vec3 axis = glm::normalize(light.center - point);
+    float cosTheta = 1.0f - u.x * cone;
+    float sinTheta = std::sqrt(std::max(0.0f, u.x * cone * (2.0f - u.x * cone)));
+    float phi = 2.0f * PI * u.y;
+    vec3 tangent, bitangent;
+    orthonormalBasis(axis, tangent, bitangent);
+
+    Ray shadow;
+    shadow.origin = point;
+    shadow.dir = glm::normalize(tangent * (sinTheta * std::cos(phi)) + bitangent * (sinTheta * std::sin(phi)) + axis * cosTheta);
+    float cosine = glm::dot(normal, shadow.dir);
+    if (cosine <= 0.0f)
+        return vec3(0, 0, 0);
+
+    // The light only counts if nothing is hit before it. Its own hit is at
+    // exactly lightDst, so it does not block itself.
+    float lightDst = intersectSphere(shadow, light);
+    if (lightDst == NO_HIT || occluded(shadow, lightDst))
+        return vec3(0, 0, 0);
+
+    float pdf = 1.0f / (float(numLights) * 2.0f * PI * cone);
+    float bsdfPdf = cosine / PI;
+    return emitted(light.material) * (cosine / PI) * misWeight(pdf, bsdfPdf) / pdf;
+}
+
+vec3 CpuTracer::trace(Ray ray, Sampler& sampler, int maxBounce, int rrMinDepth, bool nextEvent, HitInfo* firstHit) const
+{
+    vec3 incomingLight = vec3(0, 0, 0);
+    vec3 color = vec3(1, 1, 1);
+    float bsdfPdf = 0.0f; // density of the last bounce direction, 0 for camera rays
+    nextEvent = nextEvent && !lights.empty();
+    if (firstHit)
+        firstHit->hit = false;
+
+    for (int i = 0; i < maxBounce; i++)
+    {
+        HitInfo hitInfo = calcRayCollision(ray);
+        if (i == 0 && firstHit)
+            *firstHit = hitInfo;
+        if (hitInfo.hit)
+        {
+            const Material& material = hitInfo.material;
+            vec3 emission = emitted(material);
+
+            // A bounce that finds a light shares it with the light samples
+            if (nextEvent && bsdfPdf > 0.0f && emission != vec3(0, 0, 0))
+                emission *= misWeight(bsdfPdf, lightPdf(ray.origin, spheres[hitInfo.index]));
+
+            incomingLight += color * emission;
+            color *= material.color;
+
+            // Not on the last bounce: its bounce ray is never traced, so there
+            // would be nothing to weigh the light sample against
+            if (nextEvent && i + 1 < maxBounce)
+                incomingLight += color * sampleLight(hitInfo.point, hitInfo.normal, sample2D(sampler));
+
+            ray.origin = hitInfo.point;
+            ray.dir = randomHemisphereDir(hitInfo.normal, sample2D(sampler)); // Cosine-weighted direction in hemisphere
+            bsdfPdf = glm::dot(hitInfo.normal, ray.dir) / PI;
+
+            // Russian roulette: dim paths survive with a probability that follows their
+            // throughput, and survivors are scaled up so the estimate stays unbiased
+            if (i + 1 >= rrMinDepth)
+            {
+                float survival = std::min(std::max(color.r, std::max(color.g, color.b)), 1.0f);
+                if (sample1D(sampler) >= survival)
+                    break;
+                color /= survival;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    return incomingLight;
+}
+
+void CpuTracer::render(const Camera& camera, const RenderSettings& settings, vector<vec3>& image, DenoiseFeatures* features) const
+{
+    image.assign(size_t(settings.width) * settings.height, vec3(0.0f));
+    if (features)
+        features->assign(image.size());
+
+    int tilesX = (settings.width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (settings.height + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Same constants the window uploads to FrameBlock
+    FrameUniforms frame = frameUniforms(camera, settings.width, settings.height, settings.frame_index);
+
+    pool.run(tilesX * tilesY, [&](int tile)
+    {
+        renderTile(tile, frame, settings, image, features);
+    });
+}
+
+void CpuTracer::renderTile(int tile, const FrameUniforms& frame, const RenderSettings& settings, vector<vec3>& image,
+    DenoiseFeatures* features) const
+{
+    int width = settings.width;
+    int height = settings.height;
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, width);
+    int y1 = std::min(y0 + TILE_SIZE, height);
+
+    // y counts from the bottom of the window like gl_FragCoord
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            vec3 totalLight = vec3(0, 0, 0);
+            FeatureSums sums;
+            for (int i = 0; i < settings.rays_per_pixel; i++)
+            {
+                Sampler sampler = makeSampler(settings.sampler, x, y, settings.frame_index, i, settings.frame_index * settings.rays_per_pixel);
+                Ray ray = ray_setup(frame, x, y, sample2D(sampler));
+                HitInfo first;
+                vec3 light = trace(ray, sampler, settings.max_bounce, settings.rr_min_depth, settings.next_event, features ? &first : nullptr);
+                totalLight += light;
+                if (features)
+                    sums.add(first, light);
+            }
+
+            size_t pixel = size_t(height - 1 - y) * width + x;
+            image[pixel] = totalLight / float(settings.rays_per_pixel);
+            if (features)
+            {
+                blendFeatures(*features, pixel, sums, settings.rays_per_pixel, 1.0f);
+                features->samples[pixel] = settings.rays_per_pixel;
+            }
+        }
+    }
+}
+
+AdaptiveStats CpuTracer::renderAdaptive(const Camera& camera, const RenderSettings& settings, float targetError, vector<vec3>& image,
+    DenoiseFeatures* features) const
+{
+    size_t pixelCount = size_t(settings.width) * settings.height;
+    image.assign(pixelCount, vec3(0.0f));
+    if (features)
+        features->assign(pixelCount);
+    AdaptiveState state;
+    state.mean_square.assign(pixelCount, 0.0f);
+    state.samples.assign(pixelCount, 0);
+    state.active.assign(pixelCount, 1);
+
+    int tilesX = (settings.width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (settings.height + TILE_SIZE - 1) / TILE_SIZE;
+    vector<int> activeTiles(tilesX * tilesY);
+    for (int i = 0; i < tilesX * tilesY; i++)
+        activeTiles[i] = i;
+
+    FrameUniforms frame = frameUniforms(camera, settings.width, settings.height, settings.frame_index);
+
+    // Every pass continues the samples of the frame, seeded like render() with
+    // either sampler, so a pixel that never converges ends up with the samples
+    // of a fixed render
+    AdaptiveStats stats = { 0, 0.0, 0.0 };
+    for (int done = 0; done < settings.rays_per_pixel && !activeTiles.empty(); done += ADAPTIVE_PASS_SAMPLES)
+    {
+        int passSamples = std::min(ADAPTIVE_PASS_SAMPLES, settings.rays_per_pixel - done);
+        pool.run(static_cast<int>(activeTiles.size()), [&](int i)
+        {
+            adaptiveTile(activeTiles[i], stats.passes, passSamples, frame, settings, image, state, features);
+        });
+        stats.passes++;
+
+        // The errors look at neighbours in other tiles, so they are only
+        // updated once every tile finished the pass
+        vector<char> stillActive(activeTiles.size());
+        pool.run(static_cast<int>(activeTiles.size()), [&](int i)
+        {
+            stillActive[i] = retireTile(activeTiles[i], targetError, settings, image, state);
+        });
+
+        // Converged tiles retire, the next pass only hands out the others
+        size_t kept = 0;
+        for (size_t i = 0; i < activeTiles.size(); i++)
+        {
+            if (stillActive[i])
+                activeTiles[kept++] = activeTiles[i];
+        }
+        activeTiles.resize(kept);
+    }
+
+    double totalSamples = 0.0;
+    size_t converged = 0;
+    for (size_t i = 0; i < pixelCount; i++)
+    {
+        totalSamples += state.samples[i];
+        converged += state.active[i] ? 0 : 1;
+    }
+    stats.average_spp = totalSamples / double(pixelCount);
+    stats.converged_share = double(converged) / double(pixelCount);
+    if (features)
+        features->samples = state.samples;
+    return stats;
+}
+
+void CpuTracer::adaptiveTile(int tile, int pass, int passSamples, const FrameUniforms& frame,
+    const RenderSettings& settings, vector<vec3>& image, AdaptiveState& state, DenoiseFeatures* features) const
+{
+    int width = settings.width;
+    int height = settings.height;
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, width);
+    int y1 = std::min(y0 + TILE_SIZE, height);
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            size_t pixel = size_t(height - 1 - y) * width + x;
+            if (!state.active[pixel])
+                continue;
+
+            vec3 totalLight = vec3(0, 0, 0);
+            FeatureSums sums;
+            for (int i = 0; i < passSamples; i++)
+            {
+                // Sample pass * ADAPTIVE_PASS_SAMPLES + i of the frame, numbered like renderTile
+                Sampler sampler = makeSampler(settings.sampler, x, y, settings.frame_index, pass * ADAPTIVE_PASS_SAMPLES + i,
+                    settings.frame_index * settings.rays_per_pixel);
+                Ray ray = ray_setup(frame, x, y, sample2D(sampler));
+                HitInfo first;
+                vec3 light = trace(ray, sampler, settings.max_bounce, settings.rr_min_depth, settings.next_event, &first);
+                totalLight += light;
+                sums.add(first, light);
+            }
+
+            int& samples = state.samples[pixel];
+            samples += passSamples;
+            float weight = float(passSamples) / float(samples);
+            image[pixel] += (totalLight / float(passSamples) - image[pixel]) * weight;
+            state.mean_square[pixel] += (sums.square / float(passSamples) - state.mean_square[pixel]) * weight;
+            if (features)
+                blendFeatures(*features, pixel, sums, passSamples, weight);
+        }
+    }
+}
+
+bool CpuTracer::retireTile(int tile, float targetError, const RenderSettings& settings, const vector<vec3>& image, AdaptiveState& state) const
+{
+    int width = settings.width;
+    int height = settings.height;
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    int x0 = (tile % tilesX) * TILE_SIZE;
+    int y0 = (tile / tilesX) * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, width);
+    int y1 = std::min(y0 + TILE_SIZE, height);
+
+    bool active = false;
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            int row = height - 1 - y;
+            size_t pixel = size_t(row) * width + x;
+            if (!state.active[pixel])
+                continue;
+
+            float range = neighbourRange(image, width, height, x, row);
+            state.active[pixel] = !(pixelError(image[pixel], state.mean_square[pixel], state.samples[pixel], range) < targetError);
+            active = active || state.active[pixel];
+        }
+    }
+    return active;
+}
@@ -0,0 +1,112 @@
+#ifndef CPU_TRACER_H
+#define CPU_TRACER_H
+
+#include "bvh.h"
+#include "denoiser.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sphere_soa.h"
+#include "thread_pool.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// CPU reference implementation of fragment_shader.glsl. Function names follow
+// the shader so the two paths can be compared side by side.
+
+struct HitInfo
+{
+    bool hit;
+    float dst;
+    glm::vec3 point;
+    glm::vec3 normal;
+    Material material;
+    int index; // sphere that was hit
+};
+
+struct RenderSettings
+{
+    int width;
+    int height;
+    int rays_per_pixel;
+    int max_bounce;
+    int rr_min_depth; // bounces before Russian roulette may end a path, >= max_bounce turns it off
+    bool next_event; // sample the lights directly at every bounce, like NEE in the shader
+    int frame_index; // seeds the random streams like frameIndex in the shader
+    SamplerType sampler;
+};
+
+// Result of an adaptive render
+struct AdaptiveStats
+{
+    int passes;
+    double average_spp;     // samples actually traced per pixel
+    double converged_share; // pixels that stopped below the target error, 0..1
+};
+
+class CpuTracer
+{
+public:
+    // The spheres and the BVH are not copied and must outlive the tracer.
+    // Without a BVH every ray is tested against every sphere. Positions are copied
+    // into a structure of arrays for the SIMD intersection kernels.
+    CpuTracer(const Sphere* spheres, int numSpheres, const Bvh* bvh, ThreadPool& pool);
+
+    // Function to render a full frame. The image is stored row by row from the top,
+    // matching what the GLSL path shows in the window. With features the first
+    // hits and sample statistics the denoiser needs are recorded too.
+    void render(const Camera& camera, const RenderSettings& settings, std::vector<glm::vec3>& image,
+        DenoiseFeatures* features = nullptr) const;
+
+    // Function to render in passes and stop sampling each pixel once its error is
+    // below targetError, like targetError in the shader. settings.rays_per_pixel
+    // caps the samples of pixels that never get there. Tiles whose pixels all
+    // converged are no longer handed to the threads.
+    AdaptiveStats renderAdaptive(const Camera& camera, const RenderSettings& settings, float targetError, std::vector<glm::vec3>& image,
+        DenoiseFeatures* features = nullptr) const;
+
+    HitInfo calcRayCollision(const Ray& ray) const;
+
+    // Function to check whether anything is hit closer than maxDst. Cheaper than
+    // calcRayCollision: it stops at the first hit and fills in no HitInfo.
+    bool occluded(const Ray& ray, float maxDst) const;
+
+    // Function to follow one path, the sampler hands out the dimensions of every bounce.
+    // After rrMinDepth bounces Russian roulette ends paths with low throughput. With
+    // nextEvent every bounce also samples a light, weighted by MIS against the bounce.
+    // firstHit, if given, receives what the camera ray hit.
+    glm::vec3 trace(Ray ray, Sampler& sampler, int maxBounce, int rrMinDepth, bool nextEvent, HitInfo* firstHit = nullptr) const;
+
+private:
+    void renderTile(int tile, const FrameUniforms& frame, const RenderSettings& settings, std::vector<glm::vec3>& image,
+        DenoiseFeatures* features) const;
+
+    // Per-pixel running statistics of an adaptive render
+    struct AdaptiveState
+    {
+        std::vector<float> mean_square; // mean of the squared sample luminance
+        std::vector<int> samples;
+        std::vector<char> active;       // still above the target error
+    };
+
+    // Function to trace one pass over the active pixels of a tile
+    void adaptiveTile(int tile, int pass, int passSamples, const FrameUniforms& frame,
+        const RenderSettings& settings, std::vector<glm::vec3>& image, AdaptiveState& state, DenoiseFeatures* features) const;
+
+    // Function to retire the pixels of a tile that are below the target error.
+    // Returns false once all of them are.
+    bool retireTile(int tile, float targetError, const RenderSettings& settings,
+        const std::vector<glm::vec3>& image, AdaptiveState& state) const;
+
+    float lightPdf(glm::vec3 point, const Sphere& light) const;
+    glm::vec3 sampleLight(glm::vec3 point, glm::vec3 normal, glm::vec2 u) const;
+
+    const Sphere* spheres;
+    int numSpheres;
+    SphereSoA sphereSoA;
+    std::vector<int> lights; // indices of the emissive spheres
+    const Bvh* bvh;
+    ThreadPool& pool;
+};
+
+#endif // CPU_TRACER_H
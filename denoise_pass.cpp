@@ -0,0 +1,105 @@
+#include "denoise_pass.h"
+#include <iostream>
+
+DenoisePass::DenoisePass(int width, int height)
+    : width(width), height(height), render_width(width), render_height(height), current(0)
+{
+    glGenFramebuffers(2, framebuffers);
+    glGenTextures(2, textures);
+    allocateTextures();
+
+    for (int i = 0; i < 2; i++)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cerr << "ERROR::DENOISE::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void DenoisePass::allocateTextures()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+}
+
+void DenoisePass::resize(int newWidth, int newHeight)
+{
+    width = newWidth;
+    height = newHeight;
+    render_width = width;
+    render_height = height;
+    allocateTextures();
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void DenoisePass::destroy()
+{
+    glDeleteFramebuffers(2, framebuffers);
+    glDeleteTextures(2, textures);
+}
+
+void DenoisePass::run(const ShaderProgram& program, GLuint fullscreenVao, const AccumulationBuffer& accumulation, const DenoiseSettings& settings)
+{
+    program.use();
+    glUniform1i(program.uniformLocation("colorTexture"), 0);
+    glUniform1i(program.uniformLocation("momentTexture"), 1);
+    glUniform1i(program.uniformLocation("normalDepthTexture"), 2);
+    glUniform1i(program.uniformLocation("albedoTexture"), 3);
+    glUniform1f(program.uniformLocation("sigmaLuminance"), settings.sigma_luminance);
+    glUniform1f(program.uniformLocation("sigmaDepth"), settings.sigma_depth);
+    glUniform1f(program.uniformLocation("albedoScale"), 1.0f / (settings.sigma_albedo * settings.sigma_albedo));
+    glUniform1i(program.uniformLocation("normalPower"), settings.normal_power);
+    render_width = accumulation.renderWidth();
+    render_height = accumulation.renderHeight();
+    glUniform2i(program.uniformLocation("imageSize"), render_width, render_height);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, accumulation.momentTexture());
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, accumulation.normalDepthTexture());
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, accumulation.albedoTexture());
+    glActiveTexture(GL_TEXTURE0);
+
+    glViewport(0, 0, render_width, render_height);
+    glBindVertexArray(fullscreenVao);
+
+    // The first pass estimates the variance, every later one filters the result
+    // of the one before with twice the step
+    GLuint input = accumulation.averageTexture();
+    for (int iteration = 0; iteration <= settings.iterations; iteration++)
+    {
+        int target = iteration % 2;
+        glUniform1i(program.uniformLocation("stepWidth"), iteration == 0 ? 0 : 1 << (iteration - 1));
+        glBindTexture(GL_TEXTURE_2D, input);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[target]);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        input = textures[target];
+        current = target;
+    }
+
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(0);
+}
+
+void DenoisePass::present(int windowWidth, int windowHeight) const
+{
+    GLenum filter = render_width == windowWidth && render_height == windowHeight ? GL_NEAREST : GL_LINEAR;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[current]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT, filter);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
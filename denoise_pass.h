@@ -0,0 +1,45 @@
+#ifndef DENOISE_PASS_H
+#define DENOISE_PASS_H
+
+#include "accumulation.h"
+#include "denoiser.h"
+#include "shader.h"
+#include <GL/glew.h>
+
+// GL version of denoiseImage(). denoise_shader.glsl runs once per iteration over
+// the accumulated average, ping-ponging between two float targets, and the
+// features come from the accumulation buffer's extra attachments.
+class DenoisePass
+{
+public:
+    DenoisePass(int width, int height);
+
+    DenoisePass(const DenoisePass&) = delete;
+    DenoisePass& operator=(const DenoisePass&) = delete;
+
+    // Function to delete the GL objects, must run while the context is still alive
+    void destroy();
+
+    // Function to reallocate the targets for a new window size
+    void resize(int width, int height);
+
+    // Function to filter the current average of the accumulation buffer, at its render size
+    void run(const ShaderProgram& program, GLuint fullscreenVao, const AccumulationBuffer& accumulation, const DenoiseSettings& settings);
+
+    // Function to copy the filtered image to the default framebuffer
+    void present(int windowWidth, int windowHeight) const;
+
+private:
+    // Function to size both targets to width x height
+    void allocateTextures();
+
+    GLuint framebuffers[2];
+    GLuint textures[2]; // rgb, and the variance of the luminance in alpha
+    int width;
+    int height;
+    int render_width; // size of the last filtered image
+    int render_height;
+    int current; // index of the target holding the latest result
+};
+
+#endif // DENOISE_PASS_H
@@ -0,0 +1,163 @@
+#version 430 core
+// Passes of the edge-avoiding A-trous denoiser, the GL version of denoiser.cpp
+// with the same math. stepWidth 0 estimates the variance of every pixel into
+// alpha, larger steps run one filter iteration with taps that far apart.
+// Rows are walked from the top like in denoiser.cpp, so the sums round the same.
+out vec4 FragColor;
+
+uniform sampler2D colorTexture;       // rgb, and the variance of its luminance in a
+uniform sampler2D momentTexture;      // mean squared luminance and sample count
+uniform sampler2D normalDepthTexture; // first-hit normal, and its distance in w
+uniform sampler2D albedoTexture;
+
+uniform ivec2 imageSize; // the image fills the lower left of the textures
+uniform int stepWidth;
+uniform float sigmaLuminance;
+uniform float sigmaDepth;
+uniform float albedoScale; // 1 / sigma_albedo^2
+uniform int normalPower;
+
+// Pixels with fewer samples estimate their noise from the neighbourhood instead
+#define MIN_VARIANCE_SAMPLES 4
+
+// B3 spline, the 1D weights of the 5x5 kernel
+const float KERNEL[5] = float[](1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+const float GAUSS[3] = float[](0.25, 0.5, 0.25);
+
+float luminance(vec3 color)
+{
+    return 0.2126 * color.r + 0.7152 * color.g + 0.0722 * color.b;
+}
+
+// exp(x) for x <= 0, split into a power of two and a Taylor polynomial like fastExp()
+float fast_exp(float x)
+{
+    float t = max(x, -87.0) * 1.442695041;
+    float whole = floor(t);
+    float f = t - whole;
+    float p = 1.0 + f * (0.6931472 + f * (0.2402265 + f * (0.05550411 + f * (0.009618129 + f * 0.001333355))));
+    return p * intBitsToFloat((int(whole) + 127) << 23);
+}
+
+// Function to estimate the variance of the pixel's mean luminance. Pixels with
+// few samples use the spread of the luminance in their 5x5 neighbourhood.
+float estimate_variance(ivec2 pixel, ivec2 size)
+{
+    vec2 moments = texelFetch(momentTexture, pixel, 0).xy;
+    float lum = luminance(texelFetch(colorTexture, pixel, 0).rgb);
+    float samples = moments.y;
+
+    float variance;
+    if (samples >= float(MIN_VARIANCE_SAMPLES))
+    {
+        variance = max(moments.x - lum * lum, 0.0) * samples / (samples - 1.0);
+    }
+    else
+    {
+        float meanLum = 0.0;
+        float meanSquare = 0.0;
+        int count = 0;
+        for (int qy = min(pixel.y + 2, size.y - 1); qy >= max(pixel.y - 2, 0); qy--)
+        {
+            for (int qx = max(pixel.x - 2, 0); qx <= min(pixel.x + 2, size.x - 1); qx++)
+            {
+                meanLum += luminance(texelFetch(colorTexture, ivec2(qx, qy), 0).rgb);
+                meanSquare += texelFetch(momentTexture, ivec2(qx, qy), 0).x;
+                count++;
+            }
+        }
+        meanLum /= float(count);
+        meanSquare /= float(count);
+        variance = max(meanSquare - meanLum * meanLum, 0.0);
+    }
+    return variance / max(samples, 1.0);
+}
+
+// Function to blur the variance around the pixel with a 3x3 Gaussian, so single
+// noisy estimates do not decide its weight on their own
+float blurred_variance(ivec2 pixel, ivec2 size)
+{
+    float sum = 0.0;
+    float weightSum = 0.0;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        int qy = pixel.y - dy;
+        if (qy < 0 || qy >= size.y)
+            continue;
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int qx = pixel.x + dx;
+            if (qx < 0 || qx >= size.x)
+                continue;
+            float weight = GAUSS[dx + 1] * GAUSS[dy + 1];
+            sum += weight * texelFetch(colorTexture, ivec2(qx, qy), 0).a;
+            weightSum += weight;
+        }
+    }
+    return sum / weightSum;
+}
+
+// Function to run one filter iteration on the pixel. Neighbours count less the
+// more their normal, depth, albedo and luminance differ from the pixel's, and
+// the luminance difference is measured against the pixel's noise.
+vec4 filter_pixel(ivec2 pixel, ivec2 size)
+{
+    vec4 colorP = texelFetch(colorTexture, pixel, 0);
+    vec4 normalDepthP = texelFetch(normalDepthTexture, pixel, 0);
+    vec3 albedoP = texelFetch(albedoTexture, pixel, 0).rgb;
+    float lumP = luminance(colorP.rgb);
+    float lumScale = 1.0 / (sigmaLuminance * sqrt(blurred_variance(pixel, size)) + 1e-4);
+    float depthScale = 1.0 / (sigmaDepth * float(stepWidth) * max(normalDepthP.w, 1e-4));
+
+    vec4 sum = vec4(0, 0, 0, 0);
+    float weightSum = 0.0;
+    for (int ky = 0; ky < 5; ky++)
+    {
+        int qy = pixel.y - (ky - 2) * stepWidth;
+        if (qy < 0 || qy >= size.y)
+            continue;
+        for (int kx = 0; kx < 5; kx++)
+        {
+            ivec2 q = ivec2(pixel.x + (kx - 2) * stepWidth, qy);
+            if (q.x < 0 || q.x >= size.x)
+                continue;
+            vec4 colorQ = texelFetch(colorTexture, q, 0);
+
+            // The centre always counts, even for pixels without a surface
+            float weight = KERNEL[kx] * KERNEL[ky];
+            if (q != pixel)
+            {
+                vec4 normalDepthQ = texelFetch(normalDepthTexture, q, 0);
+                vec3 albedoQ = texelFetch(albedoTexture, q, 0).rgb;
+                float cosine = max(normalDepthP.x * normalDepthQ.x + normalDepthP.y * normalDepthQ.y + normalDepthP.z * normalDepthQ.z, 0.0);
+                for (int i = 1; i < normalPower; i *= 2)
+                    cosine *= cosine;
+
+                vec3 d = albedoP - albedoQ;
+                float exponent = abs(lumP - luminance(colorQ.rgb)) * lumScale
+                    + abs(normalDepthP.w - normalDepthQ.w) * depthScale
+                    + (d.r * d.r + d.g * d.g + d.b * d.b) * albedoScale;
+                weight = weight * cosine * fast_exp(-exponent);
+            }
+
+            sum.rgb += weight * colorQ.rgb;
+            sum.a += weight * weight * colorQ.a;
+            weightSum += weight;
+        }
+    }
+    return vec4(sum.rgb / weightSum, sum.a / (weightSum * weightSum));
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = imageSize;
+    if (stepWidth == 0)
+    {
+        FragColor = vec4(texelFetch(colorTexture, pixel, 0).rgb, estimate_variance(pixel, size));
+    }
+    else
+    {
+        FragColor = filter_pixel(pixel, size);
+    }
+}
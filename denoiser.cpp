@@ -0,0 +1,378 @@
+#include "denoiser.h"
+#include "sphere_soa.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+using std::vector;
+using glm::vec3;
+
+// The AVX2 kernel is compiled for its own instruction set and only called once
+// the CPU is known to support it, like the intersection kernels
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+// Keep mul + add separate so the scalar and AVX2 kernels give bit-identical results
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// Pixels with fewer samples estimate their noise from the neighbourhood instead
+#define DENOISE_MIN_VARIANCE_SAMPLES 4
+
+// B3 spline, the 1D weights of the 5x5 A-trous kernel
+static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+void DenoiseFeatures::assign(size_t pixelCount)
+{
+    normal.assign(pixelCount, vec3(0.0f));
+    depth.assign(pixelCount, 0.0f);
+    albedo.assign(pixelCount, vec3(0.0f));
+    mean_square.assign(pixelCount, 0.0f);
+    samples.assign(pixelCount, 0);
+}
+
+// One iteration of the filter. Every buffer is a plane of width * height floats.
+struct FilterPass
+{
+    int width;
+    int height;
+    int step; // distance between the kernel taps
+    const float* color[4]; // r, g, b and the variance of the luminance
+    float* result[4];
+    const float* variance; // variance after a 3x3 blur, steers the luminance weight
+    const float* normal[3];
+    const float* depth;
+    const float* albedo[3];
+    float sigma_luminance;
+    float sigma_depth;
+    float albedo_scale; // 1 / sigma_albedo^2
+    int normal_power;
+};
+
+typedef void (*RowKernel)(const FilterPass& pass, int y, int x0, int x1);
+
+static float luminance(float r, float g, float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// exp(x) for x <= 0 to about 1e-4 relative, plenty for filter weights. 2^(x log2 e)
+// is split into a power of two and a Taylor polynomial on [0, 1).
+static float fastExp(float x)
+{
+    float t = std::max(x, -87.0f) * 1.442695041f;
+    float whole = std::floor(t);
+    float f = t - whole;
+    float p = 1.0f + f * (0.6931472f + f * (0.2402265f + f * (0.05550411f + f * (0.009618129f + f * 0.001333355f))));
+
+    int32_t bits = (static_cast<int32_t>(whole) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// Function to filter the pixels [x0, x1) of row y one at a time. Taps that fall
+// outside the image are left out.
+static void filterRowScalar(const FilterPass& pass, int y, int x0, int x1)
+{
+    for (int x = x0; x < x1; x++)
+    {
+        int p = y * pass.width + x;
+        float lumP = luminance(pass.color[0][p], pass.color[1][p], pass.color[2][p]);
+        float lumScale = 1.0f / (pass.sigma_luminance * std::sqrt(pass.variance[p]) + 1e-4f);
+        float depthScale = 1.0f / (pass.sigma_depth * float(pass.step) * std::max(pass.depth[p], 1e-4f));
+
+        float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        float weightSum = 0.0f;
+        for (int ky = 0; ky < 5; ky++)
+        {
+            int qy = y + (ky - 2) * pass.step;
+            if (qy < 0 || qy >= pass.height)
+                continue;
+            for (int kx = 0; kx < 5; kx++)
+            {
+                int qx = x + (kx - 2) * pass.step;
+                if (qx < 0 || qx >= pass.width)
+                    continue;
+                int q = qy * pass.width + qx;
+
+                // The centre always counts, even for pixels without a surface
+                float weight = KERNEL[kx] * KERNEL[ky];
+                if (q != p)
+                {
+                    float cosine = std::max(pass.normal[0][p] * pass.normal[0][q] + pass.normal[1][p] * pass.normal[1][q] + pass.normal[2][p] * pass.normal[2][q], 0.0f);
+                    for (int i = 1; i < pass.normal_power; i *= 2)
+                        cosine *= cosine;
+
+                    float dr = pass.albedo[0][p] - pass.albedo[0][q];
+                    float dg = pass.albedo[1][p] - pass.albedo[1][q];
+                    float db = pass.albedo[2][p] - pass.albedo[2][q];
+                    float lumQ = luminance(pass.color[0][q], pass.color[1][q], pass.color[2][q]);
+                    float exponent = std::fabs(lumP - lumQ) * lumScale
+                        + std::fabs(pass.depth[p] - pass.depth[q]) * depthScale
+                        + (dr * dr + dg * dg + db * db) * pass.albedo_scale;
+                    weight = weight * cosine * fastExp(-exponent);
+                }
+
+                sum[0] += weight * pass.color[0][q];
+                sum[1] += weight * pass.color[1][q];
+                sum[2] += weight * pass.color[2][q];
+                sum[3] += weight * weight * pass.color[3][q];
+                weightSum += weight;
+            }
+        }
+
+        pass.result[0][p] = sum[0] / weightSum;
+        pass.result[1][p] = sum[1] / weightSum;
+        pass.result[2][p] = sum[2] / weightSum;
+        pass.result[3][p] = sum[3] / (weightSum * weightSum);
+    }
+}
+
+SIMD_TARGET("avx2")
+static __m256 fastExpAVX2(__m256 x)
+{
+    __m256 t = _mm256_mul_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(1.442695041f));
+    __m256 whole = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, whole);
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(0.009618129f), _mm256_mul_ps(f, _mm256_set1_ps(0.001333355f)));
+    p = _mm256_add_ps(_mm256_set1_ps(0.05550411f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(0.2402265f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(0.6931472f), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(f, p));
+
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(whole), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+SIMD_TARGET("avx2")
+static __m256 luminanceAVX2(__m256 r, __m256 g, __m256 b)
+{
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), r), _mm256_mul_ps(_mm256_set1_ps(0.7152f), g)),
+        _mm256_mul_ps(_mm256_set1_ps(0.0722f), b));
+}
+
+// Function to filter 8 neighbouring pixels at a time. The caller keeps [x0, x1)
+// far enough from the left and right edges that every tap column exists.
+SIMD_TARGET("avx2")
+static void filterRowAVX2(const FilterPass& pass, int y, int x0, int x1)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    int x = x0;
+    for (; x + 8 <= x1; x += 8)
+    {
+        int p = y * pass.width + x;
+        __m256 rP = _mm256_loadu_ps(pass.color[0] + p), gP = _mm256_loadu_ps(pass.color[1] + p), bP = _mm256_loadu_ps(pass.color[2] + p);
+        __m256 lumP = luminanceAVX2(rP, gP, bP);
+        __m256 lumScale = _mm256_div_ps(_mm256_set1_ps(1.0f),
+            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pass.sigma_luminance), _mm256_sqrt_ps(_mm256_loadu_ps(pass.variance + p))), _mm256_set1_ps(1e-4f)));
+        __m256 depthP = _mm256_loadu_ps(pass.depth + p);
+        __m256 depthScale = _mm256_div_ps(_mm256_set1_ps(1.0f),
+            _mm256_mul_ps(_mm256_set1_ps(pass.sigma_depth * float(pass.step)), _mm256_max_ps(depthP, _mm256_set1_ps(1e-4f))));
+        __m256 nxP = _mm256_loadu_ps(pass.normal[0] + p), nyP = _mm256_loadu_ps(pass.normal[1] + p), nzP = _mm256_loadu_ps(pass.normal[2] + p);
+        __m256 arP = _mm256_loadu_ps(pass.albedo[0] + p), agP = _mm256_loadu_ps(pass.albedo[1] + p), abP = _mm256_loadu_ps(pass.albedo[2] + p);
+
+        __m256 sumR = zero, sumG = zero, sumB = zero, sumV = zero, weightSum = zero;
+        for (int ky = 0; ky < 5; ky++)
+        {
+            int qy = y + (ky - 2) * pass.step;
+            if (qy < 0 || qy >= pass.height)
+                continue;
+            for (int kx = 0; kx < 5; kx++)
+            {
+                int q = qy * pass.width + x + (kx - 2) * pass.step;
+                __m256 rQ = _mm256_loadu_ps(pass.color[0] + q), gQ = _mm256_loadu_ps(pass.color[1] + q), bQ = _mm256_loadu_ps(pass.color[2] + q);
+                __m256 weight = _mm256_set1_ps(KERNEL[kx] * KERNEL[ky]);
+                if (q != p)
+                {
+                    __m256 cosine = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nxP, _mm256_loadu_ps(pass.normal[0] + q)),
+                        _mm256_mul_ps(nyP, _mm256_loadu_ps(pass.normal[1] + q))), _mm256_mul_ps(nzP, _mm256_loadu_ps(pass.normal[2] + q)));
+                    cosine = _mm256_max_ps(cosine, zero);
+                    for (int i = 1; i < pass.normal_power; i *= 2)
+                        cosine = _mm256_mul_ps(cosine, cosine);
+
+                    __m256 dr = _mm256_sub_ps(arP, _mm256_loadu_ps(pass.albedo[0] + q));
+                    __m256 dg = _mm256_sub_ps(agP, _mm256_loadu_ps(pass.albedo[1] + q));
+                    __m256 db = _mm256_sub_ps(abP, _mm256_loadu_ps(pass.albedo[2] + q));
+                    __m256 albedoDist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+                    __m256 lumDist = _mm256_and_ps(_mm256_sub_ps(lumP, luminanceAVX2(rQ, gQ, bQ)), absMask);
+                    __m256 depthDist = _mm256_and_ps(_mm256_sub_ps(depthP, _mm256_loadu_ps(pass.depth + q)), absMask);
+                    __m256 exponent = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lumDist, lumScale), _mm256_mul_ps(depthDist, depthScale)),
+                        _mm256_mul_ps(albedoDist, _mm256_set1_ps(pass.albedo_scale)));
+                    weight = _mm256_mul_ps(_mm256_mul_ps(weight, cosine), fastExpAVX2(_mm256_sub_ps(zero, exponent)));
+                }
+
+                sumR = _mm256_add_ps(sumR, _mm256_mul_ps(weight, rQ));
+                sumG = _mm256_add_ps(sumG, _mm256_mul_ps(weight, gQ));
+                sumB = _mm256_add_ps(sumB, _mm256_mul_ps(weight, bQ));
+                sumV = _mm256_add_ps(sumV, _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(pass.color[3] + q)));
+                weightSum = _mm256_add_ps(weightSum, weight);
+            }
+        }
+
+        _mm256_storeu_ps(pass.result[0] + p, _mm256_div_ps(sumR, weightSum));
+        _mm256_storeu_ps(pass.result[1] + p, _mm256_div_ps(sumG, weightSum));
+        _mm256_storeu_ps(pass.result[2] + p, _mm256_div_ps(sumB, weightSum));
+        _mm256_storeu_ps(pass.result[3] + p, _mm256_div_ps(sumV, _mm256_mul_ps(weightSum, weightSum)));
+    }
+    filterRowScalar(pass, y, x, x1);
+}
+
+// AVX-512 machines run the AVX2 kernel, SSE4.2 ones the scalar kernel
+static RowKernel rowKernelFor(SimdLevel level)
+{
+    return level >= SimdLevel::AVX2 ? filterRowAVX2 : filterRowScalar;
+}
+
+// Function to estimate the variance of each pixel's mean luminance. Pixels with
+// few samples use the spread of the luminance in their 5x5 neighbourhood.
+static void estimateVariance(const DenoiseFeatures& features, const vector<float>& lum, int width, int height, int y, float* variance)
+{
+    for (int x = 0; x < width; x++)
+    {
+        int p = y * width + x;
+        int samples = features.samples[p];
+        float sampleVariance;
+        if (samples >= DENOISE_MIN_VARIANCE_SAMPLES)
+        {
+            sampleVariance = std::max(features.mean_square[p] - lum[p] * lum[p], 0.0f) * float(samples) / float(samples - 1);
+        }
+        else
+        {
+            float meanLum = 0.0f, meanSquare = 0.0f;
+            int count = 0;
+            for (int qy = std::max(y - 2, 0); qy <= std::min(y + 2, height - 1); qy++)
+            {
+                for (int qx = std::max(x - 2, 0); qx <= std::min(x + 2, width - 1); qx++)
+                {
+                    meanLum += lum[qy * width + qx];
+                    meanSquare += features.mean_square[qy * width + qx];
+                    count++;
+                }
+            }
+            meanLum /= float(count);
+            meanSquare /= float(count);
+            sampleVariance = std::max(meanSquare - meanLum * meanLum, 0.0f);
+        }
+        variance[p] = sampleVariance / float(std::max(samples, 1));
+    }
+}
+
+// Function to blur the variance of one row with a 3x3 Gaussian, so single noisy
+// estimates do not decide a pixel's weight on their own
+static void blurVariance(const float* variance, int width, int height, int y, float* blurred)
+{
+    static const float GAUSS[3] = { 0.25f, 0.5f, 0.25f };
+    for (int x = 0; x < width; x++)
+    {
+        float sum = 0.0f, weightSum = 0.0f;
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            int qy = y + dy;
+            if (qy < 0 || qy >= height)
+                continue;
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                int qx = x + dx;
+                if (qx < 0 || qx >= width)
+                    continue;
+                float weight = GAUSS[dx + 1] * GAUSS[dy + 1];
+                sum += weight * variance[qy * width + qx];
+                weightSum += weight;
+            }
+        }
+        blurred[y * width + x] = sum / weightSum;
+    }
+}
+
+void denoiseImage(const vector<vec3>& image, const DenoiseFeatures& features, int width, int height,
+    const DenoiseSettings& settings, ThreadPool& pool, vector<vec3>& result)
+{
+    size_t pixelCount = size_t(width) * height;
+
+    // Planes let the kernels load 8 neighbouring pixels with one instruction
+    vector<float> planes[2][4];
+    for (int i = 0; i < 4; i++)
+    {
+        planes[0][i].resize(pixelCount);
+        planes[1][i].resize(pixelCount);
+    }
+    vector<float> guide[7];
+    for (int i = 0; i < 7; i++)
+        guide[i].resize(pixelCount);
+    vector<float> lum(pixelCount), blurred(pixelCount);
+
+    for (size_t p = 0; p < pixelCount; p++)
+    {
+        planes[0][0][p] = image[p].r;
+        planes[0][1][p] = image[p].g;
+        planes[0][2][p] = image[p].b;
+        lum[p] = luminance(image[p].r, image[p].g, image[p].b);
+        for (int i = 0; i < 3; i++)
+        {
+            guide[i][p] = features.normal[p][i];
+            guide[4 + i][p] = features.albedo[p][i];
+        }
+        guide[3][p] = features.depth[p];
+    }
+
+    pool.run(height, [&](int y)
+    {
+        estimateVariance(features, lum, width, height, y, planes[0][3].data());
+    });
+
+    RowKernel kernel = rowKernelFor(getSimdLevel());
+    int current = 0;
+    for (int iteration = 0; iteration < settings.iterations; iteration++)
+    {
+        FilterPass pass;
+        pass.width = width;
+        pass.height = height;
+        pass.step = 1 << iteration;
+        for (int i = 0; i < 4; i++)
+        {
+            pass.color[i] = planes[current][i].data();
+            pass.result[i] = planes[1 - current][i].data();
+        }
+        pass.variance = blurred.data();
+        for (int i = 0; i < 3; i++)
+        {
+            pass.normal[i] = guide[i].data();
+            pass.albedo[i] = guide[4 + i].data();
+        }
+        pass.depth = guide[3].data();
+        pass.sigma_luminance = settings.sigma_luminance;
+        pass.sigma_depth = settings.sigma_depth;
+        pass.albedo_scale = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+        pass.normal_power = settings.normal_power;
+
+        pool.run(height, [&](int y)
+        {
+            blurVariance(pass.color[3], width, height, y, blurred.data());
+        });
+
+        // Columns closer to the sides than the kernel reach lose taps and go
+        // through the scalar kernel
+        int reach = 2 * pass.step;
+        int left = std::min(reach, width);
+        int right = std::max(left, width - reach);
+        pool.run(height, [&](int y)
+        {
+            filterRowScalar(pass, y, 0, left);
+            kernel(pass, y, left, right);
+            filterRowScalar(pass, y, right, width);
+        });
+        current = 1 - current;
+    }
+
+    result.resize(pixelCount);
+    for (size_t p = 0; p < pixelCount; p++)
+        result[p] = vec3(planes[current][0][p], planes[current][1][p], planes[current][2][p]);
+}
@@ -0,0 +1,41 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "thread_pool.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// What the tracer records next to the image for the denoiser, per pixel and
+// averaged over its samples like the image. Rows run from the top like the image.
+struct DenoiseFeatures
+{
+    std::vector<glm::vec3> normal;   // first hit, zero where the camera ray missed
+    std::vector<float> depth;        // distance to the first hit, 0 on a miss
+    std::vector<glm::vec3> albedo;   // color of the first material hit, 0 on a miss
+    std::vector<float> mean_square;  // mean squared sample luminance, gives the noise
+    std::vector<int> samples;
+
+    // Function to size every buffer for an image and clear it
+    void assign(size_t pixelCount);
+};
+
+// Edge-stopping weights of the filter, the same numbers denoise_shader.glsl uses
+struct DenoiseSettings
+{
+    int iterations = 4;        // the kernel spans 2^(iterations + 2) - 3 pixels
+    float sigma_luminance = 4.0f; // in standard deviations of the pixel's noise
+    float sigma_depth = 0.02f; // relative depth change per pixel of step
+    float sigma_albedo = 0.1f;
+    int normal_power = 32;     // weight = dot(n_p, n_q)^normal_power, a power of two
+};
+
+// Function to denoise an image with an edge-avoiding A-trous wavelet filter
+// (Dammertz et al. 2010) whose luminance weight follows each pixel's variance
+// (Schied et al. 2017, SVGF). Pixels only average with neighbours of similar
+// normal, depth and albedo, and less so the less noisy they are, so a converged
+// image passes through nearly unchanged. Rows are spread over the pool, and each
+// row runs on the SIMD kernels picked by setSimdLevel().
+void denoiseImage(const std::vector<glm::vec3>& image, const DenoiseFeatures& features, int width, int height,
+    const DenoiseSettings& settings, ThreadPool& pool, std::vector<glm::vec3>& result);
+
+#endif // DENOISER_H
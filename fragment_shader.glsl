@@ -1,20 +1,107 @@
-#version 330 core
-out vec4 FragColor;
-in vec2 texCoord;
+#version 430 core
+// Pixels shaded together leave the traversal loop together. Divergent loop
+// exits are miscompiled by llvmpipe (Mesa 22.x) when the loop runs more than
+// once per invocation, and coherent exits are cheaper on SIMD hardware anyway
+#ifdef GL_ARB_shader_group_vote
+#extension GL_ARB_shader_group_vote : enable
+#define ALL_DONE(done) allInvocationsARB(done)
+#else
+#define ALL_DONE(done) (done)
+#endif
+
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec2 FragMoments;
+layout(location = 2) out vec4 FragNormalDepth; // first hit, for the denoiser
+layout(location = 3) out vec4 FragAlbedo;
 
-uniform int width ;
-uniform int height;
 uniform int numSpheres;
+uniform int numLights;
+
+// Camera and image constants, filled once per frame on the CPU (FrameUniforms in scene.h)
+layout(std140) uniform FrameBlock {
+    vec3 camera_center;
+    int width;
+    vec3 pixel00_loc;
+    int height;
+    vec3 pixel_delta_u;
+    int frameIndex; // frames already in the running average
+    vec3 pixel_delta_v;
+};
 
-uniform float focal_length_in;
-uniform float viewport_height_in;
-uniform vec3 camera_center_in;
-
-
-
-#define MAX_SPHERES 5
-#define MAX_BOUNCE 3
+// Samples every pixel was handed since the average was reset, the sequence
+// index of this frame's first sample. It is counted on the CPU because the
+// samples per frame change with the permutation.
+uniform uint firstSample;
+
+// Progressive accumulation: running average of all previous frames, and per
+// pixel the mean squared luminance of its samples and how many there were
+uniform sampler2D previousFrame;
+uniform sampler2D previousMoments;
+uniform sampler2D previousNormalDepth;
+uniform sampler2D previousAlbedo;
+// Set when the camera moved: the frame is traced on its own, and the
+// reprojection pass blends the history in afterwards
+uniform bool discardHistory;
+
+// Adaptive sampling: pixels whose error fell below this keep their average and
+// stop tracing, 0 traces every pixel every frame
+uniform float targetError;
+// Pixels with this many samples stop tracing whatever their error, 0 = no limit
+uniform float maxSamples;
+
+// Counts the pixels that traced this frame, the window stops drawing once none do
+layout(binding = 0, offset = 0) uniform atomic_uint tracedPixels;
+
+
+
+// Defaults of the final quality build, the app compiles other permutations
+// by defining these before the source
+#ifndef MAX_BOUNCE
+#define MAX_BOUNCE 8
+#endif
+#ifndef RAYS_PER_PIXEL
 #define RAYS_PER_PIXEL 4
+#endif
+
+// Samples a pixel takes before its error estimate is trusted
+#ifndef ADAPTIVE_MIN_SAMPLES
+#define ADAPTIVE_MIN_SAMPLES 16
+#endif
+
+// Bounces traced before Russian roulette may end a path
+#ifndef RR_MIN_DEPTH
+#define RR_MIN_DEPTH 3
+#endif
+
+// Next event estimation: every bounce also aims a shadow ray at a light
+#ifndef NEE
+#define NEE 1
+#endif
+
+// Sample generator for the pixel jitter and bounce directions, see sampler.h
+#define SAMPLER_PCG 0
+#define SAMPLER_SOBOL 1
+#ifndef SAMPLER
+#define SAMPLER SAMPLER_SOBOL
+#endif
+
+// Leaves pack their sphere range as first << 4 | count
+#define LEAF_COUNT_BITS 4
+#define LEAF_COUNT_MASK 15
+#define NO_HIT 1000000.0
+#define PI 3.141592653589793238
+
+// Buffer capacities, injected by SceneBuffer when the program is built
+#ifndef SPHERE_CAPACITY
+#define SPHERE_CAPACITY 64
+#endif
+#ifndef NODE_CAPACITY
+#define NODE_CAPACITY 128
+#endif
+#ifndef LIGHT_CAPACITY
+#define LIGHT_CAPACITY 8
+#endif
+
 
 struct Material
 {
@@ -31,6 +118,7 @@ struct HitInfo
     vec3 point;
     vec3 normal;
     Material material;
+    int index; // sphere that was hit
 };
 
 struct Ray
@@ -46,19 +134,35 @@ struct Sphere
     Material material;
 };
 
-layout(std140) uniform SphereBlock {
-    Sphere spheres[MAX_SPHERES]; // Max num of spheres
+// Same layout as GpuBvhNode in bvh.h. Nodes are stored depth first, so the first
+// child of an interior node is the next node and miss_index skips the subtree.
+// Walking it needs no stack, which also keeps drivers from spilling one to memory.
+struct BvhNode
+{
+    vec3 bounds_min;
+    int miss_index;
+    vec3 bounds_max;
+    int sphere_range;
 };
 
+layout(std430, binding = 0) readonly buffer SphereBuffer {
+    Sphere spheres[SPHERE_CAPACITY];
+};
 
-HitInfo hit_sphere(vec3 center, Ray ray, Sphere sphere)
-{
-    HitInfo hitInfo;
-    hitInfo.hit = false;
-    hitInfo.dst = 1000000.0f;
+layout(std430, binding = 1) readonly buffer BvhBuffer {
+    BvhNode nodes[NODE_CAPACITY];
+};
+
+// Indices of the emissive spheres
+layout(std430, binding = 2) readonly buffer LightBuffer {
+    int lights[LIGHT_CAPACITY];
+};
 
 
-    vec3 oc = ray.origin - center;
+// Returns the distance to the near root, NO_HIT if the sphere is missed
+float hit_sphere(Ray ray, Sphere sphere)
+{
+    vec3 oc = ray.origin - sphere.center;
     float a = dot(ray.dir, ray.dir);
     float b = 2.0 * dot(oc, ray.dir);
     float c = dot(oc, oc) - sphere.radius * sphere.radius;
@@ -67,89 +171,392 @@ HitInfo hit_sphere(vec3 center, Ray ray, Sphere sphere)
     if (discriminant > 0)
     {
         float temp = (-b - sqrt(discriminant)) / (2.0 * a);
-        if (temp < hitInfo.dst && temp > 0.0001)
+        if (temp < NO_HIT && temp > 0.0001)
         {
-            hitInfo.hit = true;
-            hitInfo.dst = temp;
-            hitInfo.point = ray.origin + ray.dir * temp;
-            hitInfo.normal = (hitInfo.point - center) / sphere.radius;
-            hitInfo.material = sphere.material;
+            return temp;
         }
     }
-    return hitInfo;
+    return NO_HIT;
+}
+
+// Returns the entry distance into the node, NO_HIT if it is missed or starts beyond maxDst
+float hit_bounds(BvhNode node, vec3 origin, vec3 invDir, float maxDst)
+{
+    vec3 t0 = (node.bounds_min - origin) * invDir;
+    vec3 t1 = (node.bounds_max - origin) * invDir;
+    vec3 tNear = min(t0, t1);
+    vec3 tFar = max(t0, t1);
+    float entry = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+    float exit = min(min(tFar.x, tFar.y), min(tFar.z, maxDst));
+    return entry <= exit ? entry : NO_HIT;
 }
 
-HitInfo calcRayCollision(Ray ray, Sphere spheres[MAX_SPHERES])
+HitInfo calcRayCollision(Ray ray)
 {
     HitInfo closest;
     closest.hit = false;
-    closest.dst = 1000000.0f;
+    closest.dst = NO_HIT;
+    closest.index = -1;
+
+    // NaN or zero directions cannot hit anything
+    if (numSpheres == 0 || !(dot(ray.dir, ray.dir) > 0.0))
+    {
+        return closest;
+    }
+
+    vec3 invDir = 1.0 / ray.dir;
+    float closestDst = NO_HIT;
+    int index = -1;
+    int current = 0;
 
-    for (int i = 0; i < numSpheres; i++)
+    while (!ALL_DONE(current < 0))
     {
-        HitInfo hit = hit_sphere(spheres[i].center, ray, spheres[i]);
-        if (hit.hit && hit.dst < closest.dst)
+        // Finished pixels idle until the rest of the group is done
+        if (current < 0)
         {
-            closest = hit;
+            continue;
         }
+
+        BvhNode node = nodes[current];
+        int next = node.miss_index;
+
+        // Enter the node only if it can still hold a closer hit
+        if (hit_bounds(node, ray.origin, invDir, closestDst) != NO_HIT)
+        {
+            int count = node.sphere_range & LEAF_COUNT_MASK;
+            if (count == 0)
+            {
+                next = current + 1;
+            }
+            else
+            {
+                int first = node.sphere_range >> LEAF_COUNT_BITS;
+                for (int i = first; i < first + count; i++)
+                {
+                    float dst = hit_sphere(ray, spheres[i]);
+                    if (dst < closestDst)
+                    {
+                        closestDst = dst;
+                        index = i;
+                    }
+                }
+            }
+        }
+        current = next;
+    }
+
+    // Only the closest hit pays for the point, normal and material
+    if (index >= 0)
+    {
+        Sphere sphere = spheres[index];
+        closest.hit = true;
+        closest.dst = closestDst;
+        closest.point = ray.origin + ray.dir * closestDst;
+        closest.normal = (closest.point - sphere.center) / sphere.radius;
+        closest.material = sphere.material;
+        closest.index = index;
     }
     return closest;
 }
 
-float getRandState(vec2 co)
+// Returns true if anything is hit closer than maxDst. Shadow rays need no
+// HitInfo, so the walk stops at the first hit it finds.
+bool occluded(Ray ray, float maxDst)
+{
+    if (numSpheres == 0 || !(dot(ray.dir, ray.dir) > 0.0))
+    {
+        return false;
+    }
+
+    vec3 invDir = 1.0 / ray.dir;
+    bool hit = false;
+    int current = 0;
+
+    while (!ALL_DONE(current < 0))
+    {
+        if (current < 0)
+        {
+            continue;
+        }
+
+        BvhNode node = nodes[current];
+        int next = node.miss_index;
+
+        if (hit_bounds(node, ray.origin, invDir, maxDst) != NO_HIT)
+        {
+            int count = node.sphere_range & LEAF_COUNT_MASK;
+            if (count == 0)
+            {
+                next = current + 1;
+            }
+            else
+            {
+                int first = node.sphere_range >> LEAF_COUNT_BITS;
+                for (int i = first; i < first + count; i++)
+                {
+                    hit = hit || hit_sphere(ray, spheres[i]) < maxDst;
+                }
+                next = hit ? -1 : next;
+            }
+        }
+        current = next;
+    }
+    return hit;
+}
+
+// PCG random numbers (RXS-M-XS, 32 bit state), the same functions as random.h
+// so the CPU tracer draws bit-identical streams
+uint pcgHash(uint value)
+{
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Every sample of every pixel in every frame gets an independent stream
+uint rngSeed(uvec2 pixel, uint frame, uint sampleIndex)
+{
+    return pcgHash(pixel.x + pcgHash(pixel.y + pcgHash(frame + pcgHash(sampleIndex))));
+}
+
+// Returns a uniform value in [0, 1) and advances the stream
+float randomFloat(inout uint state)
+{
+    state = state * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    return float(word >> 8u) * (1.0 / 16777216.0);
+}
+
+// Same generators as sampler.h. Every sample2D() call hands out the next pair of
+// dimensions: the first pair jitters the pixel, then one pair per bounce.
+struct Sampler
+{
+    uint rng;       // PCG: the stream state
+    uint seed;      // Sobol: per-pixel scrambling seed
+    uint index;     // Sobol: index of the sample in the pixel's sequence
+    uint dimension; // Sobol: next pair of dimensions
+};
+
+// Hash-based Owen scramble: every bit is flipped depending on the bits above it
+uint owenScramble(uint x, uint seed)
+{
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return bitfieldReverse(x);
+}
+
+uint sobolDim1(uint index)
+{
+    uint result = 0u;
+    for (uint v = 1u << 31; index != 0u; index >>= 1, v ^= v >> 1)
+    {
+        if ((index & 1u) != 0u)
+        {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// The sample index counts over all frames, so accumulation keeps walking the same sequence
+Sampler makeSampler(uvec2 pixel, uint frame, uint sampleInFrame)
+{
+    Sampler sampler;
+    sampler.rng = rngSeed(pixel, frame, sampleInFrame);
+    sampler.seed = pcgHash(pixel.x + pcgHash(pixel.y));
+    sampler.index = firstSample + sampleInFrame;
+    sampler.dimension = 0u;
+    return sampler;
+}
+
+// Returns the next two dimensions of the sample in [0, 1)
+vec2 sample2D(inout Sampler sampler)
+{
+#if SAMPLER == SAMPLER_PCG
+    float u = randomFloat(sampler.rng);
+    return vec2(u, randomFloat(sampler.rng));
+#else
+    // Each pair gets its own shuffle of the sequence so pairs stay uncorrelated
+    uint pairSeed = pcgHash(sampler.seed + pcgHash(sampler.dimension++));
+    uint index = owenScramble(sampler.index, pairSeed);
+    uint x = owenScramble(bitfieldReverse(index), pcgHash(pairSeed + 1u));
+    uint y = owenScramble(sobolDim1(index), pcgHash(pairSeed + 2u));
+    return vec2(float(x >> 8u), float(y >> 8u)) * (1.0 / 16777216.0);
+#endif
+}
+
+// Returns the next single dimension of the sample in [0, 1)
+float sample1D(inout Sampler sampler)
+{
+#if SAMPLER == SAMPLER_PCG
+    return randomFloat(sampler.rng);
+#else
+    uint pairSeed = pcgHash(sampler.seed + pcgHash(sampler.dimension++));
+    uint index = owenScramble(sampler.index, pairSeed);
+    return float(owenScramble(bitfieldReverse(index), pcgHash(pairSeed + 1u)) >> 8u) * (1.0 / 16777216.0);
+#endif
+}
+
+// Function to build an orthonormal basis around n without branching on its
+// direction (Duff et al. 2017)
+void orthonormalBasis(vec3 n, out vec3 tangent, out vec3 bitangent)
 {
-    return (fract(sin(dot(co.xy ,vec2(12.9898,78.233))) * 43758.5453));
+    float s = n.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (s + n.z);
+    float b = n.x * n.y * a;
+    tangent = vec3(1.0 + s * n.x * n.x * a, s * b, -s * n.x);
+    bitangent = vec3(b, s + n.y * n.y * a, -n.y);
 }
 
-float getRandomVal(int state)
+// Cosine-weighted direction around the normal. The pdf cancels the cosine term
+// of a diffuse surface, so a bounce only multiplies the path by the albedo.
+vec3 randomHemisphereDir(vec3 normal, vec2 u)
 {
-    state = state * 747796405 + 2891336453;
-    int res = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
-    res = (res >> 22) ^ res;
-    return float(res) / float(0x7FFFFF3F);
+    float r = sqrt(u.x);
+    float phi = 2.0 * PI * u.y;
+    vec3 tangent, bitangent;
+    orthonormalBasis(normal, tangent, bitangent);
+    return normalize(tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(max(0.0, 1.0 - u.x)));
 }
 
-float randomValNormalDist(int state)
+vec3 emitted(Material material)
 {
-    float theta = 2.0 * 3.141592653589793238 * getRandomVal(state);
-    float rho = sqrt(-2 * log(getRandomVal(state)));
-    return rho * cos(theta);
+    return material.emission_strength * material.emmision_color * 0.5;
 }
 
+// Returns 1 - cos of the half angle of the cone a light covers as seen from
+// point, 0 from inside it. Computed without the subtraction so small, far
+// away lights keep their precision.
+float light_cone(vec3 point, Sphere light)
+{
+    vec3 toCenter = light.center - point;
+    float sin2 = light.radius * light.radius / dot(toCenter, toCenter);
+    if (!(sin2 < 1.0))
+    {
+        return 0.0;
+    }
+    return sin2 / (1.0 + sqrt(1.0 - sin2));
+}
 
-vec3 getRandomVector(int state)
+// Solid angle density of sample_light() picking this light and direction
+float light_pdf(vec3 point, Sphere light)
 {
-    float x = randomValNormalDist(state);
-    float y = randomValNormalDist(state * state + int(545432 * getRandState(texCoord)));
-    float z = randomValNormalDist(state * state * state + int(432425453 * getRandState(texCoord)));
-    return normalize(vec3(x, y, z));
+    float cone = light_cone(point, light);
+    return cone > 0.0 ? 1.0 / (float(numLights) * 2.0 * PI * cone) : 0.0;
 }
 
-vec3 randomHemisphereDir(vec3 normal, int state)
+// Power heuristic weight of one sampling strategy against the other
+float mis_weight(float pdf, float otherPdf)
 {
-    vec3 dir = getRandomVector(state);
-    return dir * sign(dot(dir, normal));
+    float pdf2 = pdf * pdf;
+    return pdf2 / (pdf2 + otherPdf * otherPdf);
+}
+
+// Light reaching a diffuse point from one random light, per unit of albedo.
+// The direction is uniform in the cone the light covers, and the result is
+// weighted against the cosine bounce finding the same light.
+vec3 sample_light(vec3 point, vec3 normal, vec2 u)
+{
+    // u.x picks the light, the rest of it places the direction in the cone
+    float pick = u.x * float(numLights);
+    int slot = min(int(pick), numLights - 1);
+    u.x = pick - float(slot);
+
+    int index = lights[slot];
+    Sphere light = spheres[index];
+    float cone = light_cone(point, light);
+    if (cone <= 0.0)
+    {
+        return vec3(0, 0, 0);
+    }
+
+    vec3 axis = normalize(light.center - point);
+    float cosTheta = 1.0 - u.x * cone;
+    float sinTheta = sqrt(max(0.0, u.x * cone * (2.0 - u.x * cone)));
+    float phi = 2.0 * PI * u.y;
+    vec3 tangent, bitangent;
+    orthonormalBasis(axis, tangent, bitangent);
+
+    Ray shadow;
+    shadow.origin = point;
+    shadow.dir = normalize(tangent * (sinTheta * cos(phi)) + bitangent * (sinTheta * sin(phi)) + axis * cosTheta);
+    float cosine = dot(normal, shadow.dir);
+    if (cosine <= 0.0)
+    {
+        return vec3(0, 0, 0);
+    }
+
+    // The light only counts if nothing is hit before it. Its own hit is at
+    // exactly lightDst, so it does not block itself.
+    float lightDst = hit_sphere(shadow, light);
+    if (lightDst == NO_HIT || occluded(shadow, lightDst))
+    {
+        return vec3(0, 0, 0);
+    }
+
+    float lightPdf = 1.0 / (float(numLights) * 2.0 * PI * cone);
+    float bsdfPdf = cosine / PI;
+    return emitted(light.material) * (cosine / PI) * mis_weight(lightPdf, bsdfPdf) / lightPdf;
 }
 
-vec3 trace(Ray ray, int state)
+// firstHit receives what the camera ray hit
+vec3 trace(Ray ray, inout Sampler sampler, out HitInfo firstHit)
 {
     vec3 incomingLight = vec3(0, 0, 0);
     vec3 color  = vec3(1, 1, 1);
+    float bsdfPdf = 0.0; // density of the last bounce direction, 0 for camera rays
+    firstHit.hit = false;
     
     for (int i = 0; i < MAX_BOUNCE; i++)
     {
-        HitInfo hitInfo = calcRayCollision(ray, spheres);
+        HitInfo hitInfo = calcRayCollision(ray);
+        if (i == 0)
+        {
+            firstHit = hitInfo;
+        }
         if (hitInfo.hit)
         {
-
-            ray.origin = hitInfo.point;
-            ray.dir = randomHemisphereDir(hitInfo.normal, state + i); // Random direction in hemisphere
-            
             Material material = hitInfo.material;
-            vec3 emission = material.emission_strength * material.emmision_color;
-            incomingLight += color * emission * 0.5;
+            vec3 emission = emitted(material);
+#if NEE
+            // A bounce that finds a light shares it with the light samples
+            if (bsdfPdf > 0.0 && emission != vec3(0, 0, 0))
+            {
+                emission *= mis_weight(bsdfPdf, light_pdf(ray.origin, spheres[hitInfo.index]));
+            }
+#endif
+            incomingLight += color * emission;
             color *= material.color;
 
+#if NEE
+            // Not on the last bounce: its bounce ray is never traced, so there
+            // would be nothing to weigh the light sample against
+            if (i + 1 < MAX_BOUNCE && numLights > 0)
+            {
+                incomingLight += color * sample_light(hitInfo.point, hitInfo.normal, sample2D(sampler));
+            }
+#endif
+
+            ray.origin = hitInfo.point;
+            ray.dir = randomHemisphereDir(hitInfo.normal, sample2D(sampler)); // Cosine-weighted direction in hemisphere
+            bsdfPdf = dot(hitInfo.normal, ray.dir) / PI;
+
+            // Russian roulette: dim paths survive with a probability that follows their
+            // throughput, and survivors are scaled up so the estimate stays unbiased
+            if (i + 1 >= RR_MIN_DEPTH)
+            {
+                float survival = min(max(color.r, max(color.g, color.b)), 1.0);
+                if (sample1D(sampler) >= survival)
+                {
+                    break;
+                }
+                color /= survival;
+            }
         }
         else
         {
@@ -159,53 +566,129 @@ vec3 trace(Ray ray, int state)
     return incomingLight;
 }
 
-vec3 frag(Ray ray, Sphere spheres[MAX_SPHERES])
+Ray ray_setup(int x, int y, vec2 jitter)
 {
-    vec3 totalLight = vec3(0, 0, 0);
-
-    for (int i = 0; i < RAYS_PER_PIXEL; i++)
-    {
-        int state = int(getRandState(texCoord) * 100);
-        totalLight += trace(ray, state + i);
-    }
-
-
+    // jitter in [0, 1) spreads the samples over the pixel's area
+    vec3 pixel_sample = pixel00_loc + ((x + jitter.x - 0.5) * pixel_delta_u) + ((y + jitter.y - 0.5) * pixel_delta_v);
+    vec3 ray_direction = normalize(pixel_sample - camera_center);
 
-    return totalLight / RAYS_PER_PIXEL;
+    Ray ray;
+    ray.origin = camera_center;
+    ray.dir = ray_direction;
+    return ray;
 }
 
-Ray ray_setup(int x, int y)
+float luminance(vec3 color)
 {
-    
-    float focal_length = focal_length_in;
-    float viewport_height = viewport_height_in;
-    vec3 camera_center = camera_center_in;
-    float viewport_width = viewport_height * (float(width) / height);
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
 
-    vec3 viewport_u = vec3(viewport_width, 0, 0);
-    vec3 viewport_v = vec3(0, -viewport_height, 0);
+// Same estimate as pixelError() in cpu_tracer.cpp: the standard error of the
+// luminance over its square root, plus what a detail covering 1/samples of the
+// pixel could still change, bounded by the neighbours' luminance range
+float pixel_error(vec3 mean, vec2 moments, float range)
+{
+    float samples = moments.y;
+    if (samples < float(ADAPTIVE_MIN_SAMPLES))
+    {
+        return NO_HIT;
+    }
+    float lum = luminance(mean);
+    float variance = max(moments.x - lum * lum, 0.0);
+    float missed = range / samples;
+    return sqrt((variance / (samples - 1.0) + missed * missed) / max(lum, 1e-4));
+}
 
-    vec3 pixel_delta_u = viewport_u / float(width);
-    vec3 pixel_delta_v = viewport_v / float(height);
+// Function to get the luminance range of a pixel and its 8 neighbours in the
+// previous average
+float neighbour_range(ivec2 pixel)
+{
+    float low = NO_HIT;
+    float high = 0.0;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            ivec2 neighbour = clamp(pixel + ivec2(dx, dy), ivec2(0), ivec2(width - 1, height - 1));
+            float lum = luminance(texelFetch(previousFrame, neighbour, 0).rgb);
+            low = min(low, lum);
+            high = max(high, lum);
+        }
+    }
+    return high - low;
+}
 
-    vec3 viewport_upper_left = camera_center - vec3(0, 0, focal_length) - viewport_u / 2.0f - viewport_v / 2.0f;
-    vec3 pixel00_loc = viewport_upper_left + 0.5f * (pixel_delta_u + pixel_delta_v);
+// Function to trace the pixel's samples for this frame. Next to the average
+// light it returns the averages the denoiser needs: the squared luminance and
+// the normal, distance and color of the first hit (zero where it missed).
+vec3 frag(ivec2 pixel, out float meanSquare, out vec4 normalDepth, out vec3 albedo)
+{
+    vec3 totalLight = vec3(0, 0, 0);
+    meanSquare = 0.0;
+    normalDepth = vec4(0, 0, 0, 0);
+    albedo = vec3(0, 0, 0);
 
-    vec3 pixel_center = pixel00_loc + (x * pixel_delta_u) + (y * pixel_delta_v);
-    vec3 ray_direction = normalize(pixel_center - camera_center);
+    for (int i = 0; i < RAYS_PER_PIXEL; i++)
+    {
+        Sampler sampler = makeSampler(uvec2(pixel), uint(frameIndex), uint(i));
+        Ray ray = ray_setup(pixel.x, pixel.y, sample2D(sampler));
+        HitInfo first;
+        vec3 light = trace(ray, sampler, first);
+        totalLight += light;
+        if (first.hit)
+        {
+            normalDepth += vec4(first.normal, first.dst);
+            albedo += first.material.color;
+        }
+        meanSquare += luminance(light) * luminance(light);
+    }
 
-    Ray ray;
-    ray.origin = camera_center;
-    ray.dir = ray_direction;
-    return ray;
+    meanSquare /= RAYS_PER_PIXEL;
+    normalDepth /= RAYS_PER_PIXEL;
+    albedo /= RAYS_PER_PIXEL;
+    return totalLight / RAYS_PER_PIXEL;
 }
 
 void main()
 {
-    int x = int(texCoord.x * float(width));
-    int y = int(texCoord.y * float(height));
+    // The viewport matches the image, so the fragment position is the pixel
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+
+    // Frame 0 starts a new average
+    vec3 average = vec3(0, 0, 0);
+    vec2 moments = vec2(0, 0);
+    vec4 normalDepth = vec4(0, 0, 0, 0);
+    vec3 albedo = vec3(0, 0, 0);
+    if (frameIndex > 0 && !discardHistory)
+    {
+        average = texelFetch(previousFrame, pixel, 0).rgb;
+        moments = texelFetch(previousMoments, pixel, 0).xy;
+        normalDepth = texelFetch(previousNormalDepth, pixel, 0);
+        albedo = texelFetch(previousAlbedo, pixel, 0).rgb;
+    }
 
-    Ray ray = ray_setup(x, y);
+    // Converged pixels carry their average over without tracing
+    bool converged = (maxSamples > 0.0 && moments.y >= maxSamples)
+        || (targetError > 0.0 && pixel_error(average, moments, neighbour_range(pixel)) < targetError);
+    if (!converged)
+    {
+        atomicCounterIncrement(tracedPixels);
+
+        // Blend this frame into the running average, weighted by its share of the samples
+        float frameSquare;
+        vec4 frameNormalDepth;
+        vec3 frameAlbedo;
+        vec3 color = frag(pixel, frameSquare, frameNormalDepth, frameAlbedo);
+        float samples = moments.y + float(RAYS_PER_PIXEL);
+        float weight = float(RAYS_PER_PIXEL) / samples;
+        average = average + (color - average) * weight;
+        moments = vec2(moments.x + (frameSquare - moments.x) * weight, samples);
+        normalDepth = normalDepth + (frameNormalDepth - normalDepth) * weight;
+        albedo = albedo + (frameAlbedo - albedo) * weight;
+    }
 
-    FragColor = vec4(frag(ray, spheres), 1.0);
+    FragColor = vec4(average, 1.0);
+    FragMoments = moments;
+    FragNormalDepth = normalDepth;
+    FragAlbedo = vec4(albedo, 1.0);
 }
@@ -0,0 +1,268 @@
+#include "image_io.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using std::string;
+using std::vector;
+using glm::vec3;
+
+static void putU32BE(vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back(uint8_t(value >> 24));
+    out.push_back(uint8_t(value >> 16));
+    out.push_back(uint8_t(value >> 8));
+    out.push_back(uint8_t(value));
+}
+
+template <typename T>
+static void putLE(vector<uint8_t>& out, T value)
+{
+    uint8_t bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    // Every target we build for is little-endian
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void putString(vector<uint8_t>& out, const char* text)
+{
+    out.insert(out.end(), text, text + std::strlen(text) + 1);
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size)
+{
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        tableReady = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void putChunk(vector<uint8_t>& out, const char* type, const vector<uint8_t>& data)
+{
+    putU32BE(out, uint32_t(data.size()));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    putU32BE(out, crc32(out.data() + start, out.size() - start));
+}
+
+static bool writeFile(const string& path, const void* data, size_t size)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+    file.write(static_cast<const char*>(data), size);
+    return file.good();
+}
+
+bool writePNG(const string& path, const vector<vec3>& image, int width, int height)
+{
+    // Raw scanlines, each prefixed with filter type 0
+    vector<uint8_t> raw;
+    raw.reserve(size_t(height) * (size_t(width) * 3 + 1));
+    for (int y = 0; y < height; y++)
+    {
+        raw.push_back(0);
+        for (int x = 0; x < width; x++)
+        {
+            vec3 color = glm::clamp(image[size_t(y) * width + x], 0.0f, 1.0f);
+            for (int c = 0; c < 3; c++)
+                raw.push_back(uint8_t(color[c] * 255.0f + 0.5f));
+        }
+    }
+
+    // zlib stream made of stored deflate blocks, so no compressor is needed
+    vector<uint8_t> zlib = { 0x78, 0x01 };
+    uint32_t adlerA = 1, adlerB = 0;
+    for (uint8_t byte : raw)
+    {
+        adlerA = (adlerA + byte) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+    }
+    size_t offset = 0;
+    do
+    {
+        size_t blockSize = std::min<size_t>(raw.size() - offset, 65535);
+        bool last = offset + blockSize == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(uint8_t(blockSize));
+        zlib.push_back(uint8_t(blockSize >> 8));
+        zlib.push_back(uint8_t(~blockSize));
+        zlib.push_back(uint8_t(~blockSize >> 8));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+        offset += blockSize;
+    } while (offset < raw.size());
+    putU32BE(zlib, (adlerB << 16) | adlerA);
+
+    vector<uint8_t> header;
+    putU32BE(header, uint32_t(width));
+    putU32BE(header, uint32_t(height));
+    header.push_back(8); // bit depth
+    header.push_back(2); // truecolor RGB
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    vector<uint8_t> png(signature, signature + 8);
+    putChunk(png, "IHDR", header);
+    putChunk(png, "IDAT", zlib);
+    putChunk(png, "IEND", {});
+
+    return writeFile(path, png.data(), png.size());
+}
+
+bool writePFM(const string& path, const vector<vec3>& image, int width, int height)
+{
+    // Negative scale marks little-endian data, rows go from the bottom up
+    string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    vector<uint8_t> pfm(header.begin(), header.end());
+    pfm.reserve(pfm.size() + size_t(width) * height * sizeof(vec3));
+    for (int y = height - 1; y >= 0; y--)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const vec3& color = image[size_t(y) * width + x];
+            for (int c = 0; c < 3; c++)
+                putLE(pfm, color[c]);
+        }
+    }
+    return writeFile(path, pfm.data(), pfm.size());
+}
+
+bool writeEXR(const string& path, const vector<vec3>& image, int width, int height)
+{
+    vector<uint8_t> exr;
+    putLE(exr, int32_t(20000630)); // magic number
+    putLE(exr, int32_t(2));        // version 2, single part scanline
+
+    // Channels must be sorted by name
+    const char* channelNames[3] = { "B", "G", "R" };
+    const int channelIndex[3] = { 2, 1, 0 };
+
+    putString(exr, "channels");
+    putString(exr, "chlist");
+    putLE(exr, int32_t(3 * (2 + 16) + 1));
+    for (const char* name : channelNames)
+    {
+        putString(exr, name);
+        putLE(exr, int32_t(2)); // FLOAT
+        putLE(exr, int32_t(0)); // pLinear and reserved bytes
+        putLE(exr, int32_t(1)); // x sampling
+        putLE(exr, int32_t(1)); // y sampling
+    }
+    exr.push_back(0);
+
+    putString(exr, "compression");
+    putString(exr, "compression");
+    putLE(exr, int32_t(1));
+    exr.push_back(0); // NO_COMPRESSION
+
+    for (const char* window : { "dataWindow", "displayWindow" })
+    {
+        putString(exr, window);
+        putString(exr, "box2i");
+        putLE(exr, int32_t(16));
+        putLE(exr, int32_t(0));
+        putLE(exr, int32_t(0));
+        putLE(exr, int32_t(width - 1));
+        putLE(exr, int32_t(height - 1));
+    }
+
+    putString(exr, "lineOrder");
+    putString(exr, "lineOrder");
+    putLE(exr, int32_t(1));
+    exr.push_back(0); // INCREASING_Y
+
+    putString(exr, "pixelAspectRatio");
+    putString(exr, "float");
+    putLE(exr, int32_t(4));
+    putLE(exr, 1.0f);
+
+    putString(exr, "screenWindowCenter");
+    putString(exr, "v2f");
+    putLE(exr, int32_t(8));
+    putLE(exr, 0.0f);
+    putLE(exr, 0.0f);
+
+    putString(exr, "screenWindowWidth");
+    putString(exr, "float");
+    putLE(exr, int32_t(4));
+    putLE(exr, 1.0f);
+
+    exr.push_back(0); // end of header
+
+    // One scanline per block: y, data size, then each channel's row
+    uint64_t lineSize = 8 + uint64_t(width) * 3 * sizeof(float);
+    uint64_t firstLine = exr.size() + uint64_t(height) * sizeof(uint64_t);
+    for (int y = 0; y < height; y++)
+        putLE(exr, uint64_t(firstLine + y * lineSize));
+
+    for (int y = 0; y < height; y++)
+    {
+        putLE(exr, int32_t(y));
+        putLE(exr, int32_t(width * 3 * sizeof(float)));
+        for (int c = 0; c < 3; c++)
+        {
+            for (int x = 0; x < width; x++)
+                putLE(exr, image[size_t(y) * width + x][channelIndex[c]]);
+        }
+    }
+
+    return writeFile(path, exr.data(), exr.size());
+}
+
+typedef bool (*ImageWriter)(const string& path, const vector<vec3>& image, int width, int height);
+
+// Function to find the writer for the file extension of a path, null if there is none
+static ImageWriter findImageWriter(const string& path)
+{
+    size_t dot = path.find_last_of("./\\");
+    if (dot == string::npos || path[dot] != '.')
+        return nullptr;
+    string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    if (extension == "png")
+        return writePNG;
+    if (extension == "pfm")
+        return writePFM;
+    if (extension == "exr")
+        return writeEXR;
+    return nullptr;
+}
+
+bool imageFormatSupported(const string& path)
+{
+    return findImageWriter(path) != nullptr;
+}
+
+bool writeImage(const string& path, const vector<vec3>& image, int width, int height)
+{
+    ImageWriter writer = findImageWriter(path);
+    if (!writer)
+    {
+        std::cerr << "Unknown image format: " << path << std::endl;
+        return false;
+    }
+    return writer(path, image, width, height);
+}
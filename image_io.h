@@ -0,0 +1,26 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+// All writers take linear RGB stored row by row from the top of the image.
+
+// Function to write an 8-bit PNG, values are clamped to [0, 1] like the window framebuffer
+bool writePNG(const std::string& path, const std::vector<glm::vec3>& image, int width, int height);
+
+// Function to write a float PFM (Portable Float Map)
+bool writePFM(const std::string& path, const std::vector<glm::vec3>& image, int width, int height);
+
+// Function to write an uncompressed float OpenEXR image
+bool writeEXR(const std::string& path, const std::vector<glm::vec3>& image, int width, int height);
+
+// Function to check whether writeImage() knows the file extension of a path,
+// so a bad output name is caught before anything is rendered
+bool imageFormatSupported(const std::string& path);
+
+// Function to pick the writer from the file extension (.png, .pfm or .exr)
+bool writeImage(const std::string& path, const std::vector<glm::vec3>& image, int width, int height);
+
+#endif // IMAGE_IO_H
@@ -4,6 +4,16 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include "shader.h"
+#include "scene.h"
+#include "offline_render.h"
+#include "accumulation.h"
+#include "denoise_pass.h"
+#include "quality_controller.h"
+#include "bvh.h"
+#include "scene_buffer.h"
+#include "scene_file.h"
+#include "sampler.h"
+#include <algorithm>
 #include <vector>
 
 
@@ -11,41 +21,69 @@ using std::vector;
 using glm::vec3;
 using glm::vec4;
 
-struct Material
+// State shared with the GLFW callbacks through the window user pointer
+struct AppState
 {
-    vec3 color;
-    float emission_strength;
-    vec3 emmision_color;
-    float reflection_strength;
+    Camera camera;
+    bool camera_changed; // set by the callbacks, the main loop reprojects the average
+    bool next_event;     // which shader permutation draws, toggled with N
+    bool denoise;        // filter the average before showing it, toggled with D
+    bool redraw;         // the window needs a frame even if the image has converged
+    bool restart;        // the average was sampled differently, start a new one
+    bool resized;        // the framebuffer changed size, the targets must follow
 };
 
-struct Sphere
+// Callback function for handling key presses
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-    vec3 center;
-    float radius;
-    Material material;
-};
+    AppState* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    if (key == GLFW_KEY_N && action == GLFW_PRESS)
+    {
+        state->next_event = !state->next_event;
+        std::cout << "Next event estimation " << (state->next_event ? "on" : "off") << std::endl;
+        // Converged pixels would never trace with the new permutation
+        state->restart = true;
+    }
+    if (key == GLFW_KEY_D && action == GLFW_PRESS)
+    {
+        state->denoise = !state->denoise;
+        std::cout << "Denoiser " << (state->denoise ? "on" : "off") << std::endl;
+        state->redraw = true;
+    }
+}
 
-struct Camera
+// Callback function for when the framebuffer changed size, the main loop
+// reallocates the render targets
+void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    vec3 camera_center;
-    float focal_length;
-    float viewport_height;
-};
+    AppState* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    state->resized = true;
+    state->redraw = true;
+}
 
+// Callback function for when the window contents were lost, e.g. after it was
+// uncovered or resized
+void refresh_callback(GLFWwindow* window)
+{
+    AppState* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    state->redraw = true;
+}
 
 // Callback function for handling scroll events
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
     // Update camera focal length based on scroll direction
-    Camera* camera = static_cast<Camera*>(glfwGetWindowUserPointer(window));
+    AppState* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    Camera* camera = &state->camera;
 	camera->focal_length += yoffset * 0.1f;
+    state->camera_changed = true;
 }
 
 // Callback function for handling cursor position events
 void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 {
-    Camera* camera = static_cast<Camera*>(glfwGetWindowUserPointer(window));
+    AppState* state = static_cast<AppState*>(glfwGetWindowUserPointer(window));
+    Camera* camera = &state->camera;
     // Update camera position based on cursor movement
     if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
     {
@@ -56,6 +94,7 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 
         // Adjust camera_center based on cursor movement
         camera->camera_center += vec3(deltaX * 0.01f, -deltaY * 0.01f, 0.0f);
+        state->camera_changed = state->camera_changed || deltaX != 0.0 || deltaY != 0.0;
 
         lastX = xpos;
         lastY = ypos;
@@ -65,7 +104,6 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
     if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS)
     {
         static double lastX = xpos, lastY = ypos;
-        Camera* camera = static_cast<Camera*>(glfwGetWindowUserPointer(window));
 
         double deltaX = - ( xpos - lastX );
         double deltaY = ypos - lastY;
@@ -80,77 +118,144 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 
         glm::vec4 newCameraCenter = rotationMatrix * glm::vec4(camera->camera_center, 1.0f);
         camera->camera_center = glm::vec3(newCameraCenter);
+        state->camera_changed = state->camera_changed || deltaX != 0.0 || deltaY != 0.0;
 
         lastX = xpos;
         lastY = ypos;
     }
 }
 
-// Function to render the scene using the shader program
-void renderScene(GLuint shaderProgram, int width, int height, GLuint sphereBuffer, int numSpheres, Camera camera)
-{
-    glUseProgram(shaderProgram);
+// Binding point of the FrameBlock uniform buffer
+#define FRAME_BLOCK_BINDING 0
 
-    // Set the uniform variables
-    // pass the screen vars
-    glUniform1i(glGetUniformLocation(shaderProgram, "width"), width);
-    glUniform1i(glGetUniformLocation(shaderProgram, "height"), height);
+// Samples per pixel and frame at full quality, and the fewest samples and
+// bounces the frame budget may lower a moving view to
+#define FINAL_RAYS_PER_PIXEL 4
+#define MIN_RAYS_PER_PIXEL 1
+#define MIN_MAX_BOUNCE 2
 
-    // pass the objects
-    glUniform1i(glGetUniformLocation(shaderProgram, "numSpheres"), numSpheres);
-
-    // pass the camera vars
-    glUniform1f(glGetUniformLocation(shaderProgram, "focal_length_in"), camera.focal_length);
-    glUniform1f(glGetUniformLocation(shaderProgram, "viewport_height_in"), camera.viewport_height);
-    glUniform3fv(glGetUniformLocation(shaderProgram, "camera_center_in"), 1, &camera.camera_center[0]);
-
-    // Bind the sphere buffer
-    glBindBufferBase(GL_UNIFORM_BUFFER, 0, sphereBuffer);
-
-    // Draw a full-screen quad
-    glBegin(GL_TRIANGLES);
-    glVertex2f(-1.0f, -1.0f);
-    glVertex2f(1.0f, -1.0f);
-    glVertex2f(1.0f, 1.0f);
-    glVertex2f(-1.0f, -1.0f);
-    glVertex2f(1.0f, 1.0f);
-    glVertex2f(-1.0f, 1.0f);
-    glEnd();
+// Error at which pixels stop sampling when --target-error is not given
+#define WINDOW_TARGET_ERROR 0.005f
 
-    glUseProgram(0);
+// Samples after which a pixel stops even if it never reaches the target error,
+// so every still image converges and the window can stop drawing
+#define WINDOW_MAX_SAMPLES 4096.0f
+
+// Longest wait for events while idle, in seconds. Shader edits are only seen
+// when the loop wakes up.
+#define IDLE_POLL_SECONDS 0.25
+
+// Function to get the defines of the shader permutation drawing a quality level
+ShaderDefines permutationDefines(const QualityLevel& level, bool nextEvent, const OfflineOptions& options)
+{
+    ShaderDefines defines;
+    defines["RAYS_PER_PIXEL"] = level.rays_per_pixel;
+    defines["MAX_BOUNCE"] = level.max_bounce;
+    defines["RR_MIN_DEPTH"] = options.rr_min_depth;
+    defines["NEE"] = nextEvent ? 1 : 0;
+    return defines;
 }
 
-vector<Sphere> spheresSetup()
+// Function to render the scene using the shader program, which traces
+// raysPerPixel samples per pixel. With discardHistory the frame is traced on its
+// own, for reprojectHistory() to blend in the history.
+void renderScene(const ShaderProgram& program, GLuint fullscreenVao, int width, int height, int raysPerPixel, const SceneBuffer& scene, Camera camera, float targetError, float maxSamples, bool discardHistory, UniformBuffer& frameBlock, AccumulationBuffer& accumulation)
 {
-    Sphere sun = { vec3(50.0f, -101.0f, -105.0f), 100.0f, vec3(0.0f, 0.0f, 1.0f), 5.0f, vec3(1.0f, 1.0f, 1.0f),  0.5f };
+    // Texture unit 0 holds the previous average, units 1 to 3 its sample
+    // statistics and the first-hit features
+    accumulation.begin(0);
+    program.use();
 
-    // Create a vector for the spheres
-    vector<Sphere> spheres = {
-        {vec3(0.0f, 0.0f, -3.0f), 1.0f, vec3(1.0f, 0.0f, 0.0f), 0.0f, vec3(0, 0, 0),  0.0f},
-        {vec3(-1.5f, 0.0f, -2.0f), 0.5f, vec3(1.0f, 1.0f, 0.0f), 0.0f, vec3(0, 0, 0),  0.0f},
-        {vec3(-2.0f, 10.5f, -4.0f), 10.0f, vec3(0.5f, 0.0f, 0.5f), 0.0f, vec3(0, 0, 0),  0.0f},
-    };
+    // The camera constants go over in one upload instead of one call per uniform
+    FrameUniforms frame = frameUniforms(camera, width, height, accumulation.frameCount());
+    frameBlock.update(&frame);
+    frameBlock.bind(FRAME_BLOCK_BINDING);
 
-    spheres.push_back(sun);
-    return spheres;
-}
+    // pass the objects
+    glUniform1i(program.uniformLocation("numSpheres"), scene.sphereCount());
+    glUniform1i(program.uniformLocation("numLights"), scene.lightCount());
+
+    // pass the accumulation vars
+    glUniform1i(program.uniformLocation("previousFrame"), 0);
+    glUniform1i(program.uniformLocation("previousMoments"), 1);
+    glUniform1i(program.uniformLocation("previousNormalDepth"), 2);
+    glUniform1i(program.uniformLocation("previousAlbedo"), 3);
+    glUniform1i(program.uniformLocation("discardHistory"), discardHistory ? 1 : 0);
+    glUniform1f(program.uniformLocation("targetError"), targetError);
+    glUniform1f(program.uniformLocation("maxSamples"), maxSamples);
+    glUniform1ui(program.uniformLocation("firstSample"), accumulation.sampleCount());
+
+    // Bind the sphere, BVH and light buffers
+    scene.bind(0, 1, 2);
+
+    // Draw a full-screen triangle, the vertex shader places the corners
+    glBindVertexArray(fullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
 
+    glUseProgram(0);
+    accumulation.end(raysPerPixel);
+}
 
-Camera cameraSetup()
+// Function to blend the average rendered with the previous camera into the frame
+// just traced, each pixel taking the history from where the previous camera saw
+// its first hit. The FrameBlock must still hold the frame's camera.
+void reprojectHistory(const ShaderProgram& program, GLuint fullscreenVao, const FrameUniforms& previous, AccumulationBuffer& accumulation)
 {
-    Camera camera = { vec3(0.0f, 0.0f, 0.0f), 1.0f, 2.0f };
-    return camera;
+    // Units 0 to 3 hold the history, units 4 to 7 the frame
+    accumulation.beginReprojection(0);
+    program.use();
+
+    glUniform1i(program.uniformLocation("historyColor"), 0);
+    glUniform1i(program.uniformLocation("historyMoments"), 1);
+    glUniform1i(program.uniformLocation("historyNormalDepth"), 2);
+    glUniform1i(program.uniformLocation("historyAlbedo"), 3);
+    glUniform1i(program.uniformLocation("frameColor"), 4);
+    glUniform1i(program.uniformLocation("frameMoments"), 5);
+    glUniform1i(program.uniformLocation("frameNormalDepth"), 6);
+    glUniform1i(program.uniformLocation("frameAlbedo"), 7);
+    glUniform3fv(program.uniformLocation("previousCameraCenter"), 1, &previous.camera_center.x);
+    glUniform3fv(program.uniformLocation("previousPixel00"), 1, &previous.pixel00_loc.x);
+    glUniform3fv(program.uniformLocation("previousDeltaU"), 1, &previous.pixel_delta_u.x);
+    glUniform3fv(program.uniformLocation("previousDeltaV"), 1, &previous.pixel_delta_v.x);
+    glUniform2i(program.uniformLocation("previousSize"), previous.width, previous.height);
+
+    glBindVertexArray(fullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glUseProgram(0);
+    accumulation.endReprojection();
 }
 
+int main(int argc, char** argv) {
+    OfflineOptions options;
+    if (!parseOfflineOptions(argc, argv, options)) {
+        printOfflineUsage(argv[0]);
+        return -1;
+    }
+
+    if (!options.convert_input.empty()) {
+        return convertSceneText(options.convert_input, options.convert_output) ? 0 : -1;
+    }
 
+    // Batch renders run on the CPU and never touch GLFW or GL
+    if (options.headless) {
+        return runOfflineRender(options);
+    }
 
-int main() {
     // Initialize GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
         return -1;
     }
 
+    // The shader reads the scene from shader storage buffers
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
     // Create a GLFW window
     GLFWwindow* window = glfwCreateWindow(1200, 900, "Ray Tracing - FPS: ", NULL, NULL);
     if (!window) {
@@ -162,11 +267,14 @@ int main() {
     // Make the OpenGL context current
     glfwMakeContextCurrent(window);
 
-    // Initialize GLEW
+    // Initialize GLEW. Core contexts need the experimental path to load every
+    // entry point, and glewInit leaves a harmless GL_INVALID_ENUM behind.
+    glewExperimental = GL_TRUE;
     if (glewInit() != GLEW_OK) {
         std::cerr << "Failed to initialize GLEW" << std::endl;
         return -1;
     }
+    glGetError();
 
     // Set the viewport
     int width, height;
@@ -174,31 +282,171 @@ int main() {
     glViewport(0, 0, width, height);
 
 
-    vector<Sphere> spheres = spheresSetup();
-    Camera camera = cameraSetup();
+    // The shader only walks the BVH. Scene files carry a prebuilt one, otherwise
+    // the build reorders the spheres to match it
+    SceneData sceneData;
+    if (!loadScene(options.scene_path, options.extra_spheres, true, sceneData)) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return -1;
+    }
+    AppState state = { sceneData.camera, false, options.next_event, true, true, false, false };
 
-    glfwSetWindowUserPointer(window, &camera);
+    glfwSetWindowUserPointer(window, &state);
 
     // Set up callback functions
     glfwSetScrollCallback(window, scroll_callback);
     glfwSetCursorPosCallback(window, cursor_position_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+
+    // Upload the spheres and the BVH, the buffers are sized to the scene. Mapped
+    // scene files go to the driver without an intermediate copy.
+    SceneBuffer scene;
+    scene.upload(sceneData.spheres, sceneData.sphere_count, sceneData.gpu_nodes, sceneData.gpu_node_count);
+
+    // Compile and link shaders, the arrays are sized to the buffer capacities.
+    // Rebuild the program whenever a later upload() grows the buffers.
+    SamplerType sampler = SamplerType::Sobol;
+    parseSamplerType(options.sampler.c_str(), sampler);
+    std::string defines = scene.shaderDefines() + "#define SAMPLER " + std::to_string(int(sampler)) + "\n";
+    ShaderPermutations programs("vertex_shader.glsl", "fragment_shader.glsl", defines);
+    programs.bindUniformBlock("FrameBlock", FRAME_BLOCK_BINDING);
+
+    // Every quality level is built up front so the first camera move does not
+    // stall. Later launches load the linked binaries from shader_cache/ instead
+    // of compiling.
+    QualityController quality(qualityLadder(FINAL_RAYS_PER_PIXEL, options.max_bounce, MIN_RAYS_PER_PIXEL, MIN_MAX_BOUNCE),
+        options.frame_budget_ms);
+    double loadStart = glfwGetTime();
+    ShaderProgram* program = programs.get(permutationDefines(quality.level(0), state.next_event, options));
+    int programRays = quality.level(0).rays_per_pixel; // samples per pixel the program in use traces
+    bool built = program != nullptr;
+    for (int i = 1; i < quality.levelCount() && built; i++) {
+        built = programs.get(permutationDefines(quality.level(i), state.next_event, options)) != nullptr;
+    }
+    ShaderProgram denoiseProgram;
+    ShaderProgram reprojectProgram;
+    if (!built
+        || !denoiseProgram.load("vertex_shader.glsl", "denoise_shader.glsl")
+        || !reprojectProgram.load("vertex_shader.glsl", "reproject_shader.glsl")) {
+        reprojectProgram.destroy();
+        denoiseProgram.destroy();
+        programs.destroy();
+        scene.destroy();
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return -1;
+    }
+    std::cout << "Shader programs " << (program->loadedFromCache() ? "loaded from cache" : "compiled")
+              << " in " << (glfwGetTime() - loadStart) * 1000.0 << " ms" << std::endl;
+    UniformBuffer frameBlock(sizeof(FrameUniforms));
+    reprojectProgram.bindUniformBlock("FrameBlock", FRAME_BLOCK_BINDING);
+
+    // Saving a shader rebuilds the programs in the background, the old ones keep
+    // drawing until the new ones link
+    ShaderWatcher shaderWatcher({ "vertex_shader.glsl", "fragment_shader.glsl", "denoise_shader.glsl", "reproject_shader.glsl" });
+
+    // Core profile draws need a vertex array, even one without attributes
+    GLuint fullscreenVao;
+    glGenVertexArrays(1, &fullscreenVao);
+
+    // Converged pixels stop tracing, so a still image gets cheaper over time
+    float targetError = options.target_error > 0.0f ? options.target_error : WINDOW_TARGET_ERROR;
 
-    // Create and fill the sphere buffer
-    GLuint sphereBuffer;
-    glGenBuffers(1, &sphereBuffer);
-    glBindBuffer(GL_UNIFORM_BUFFER, sphereBuffer);
-    glBufferData(GL_UNIFORM_BUFFER, spheres.size() * sizeof(Sphere), spheres.data(), GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    // Frames are averaged here. When the camera moves the average is reprojected
+    // to the new view, so it is the camera of the last frame that is kept.
+    AccumulationBuffer accumulation(width, height);
+    FrameUniforms lastFrame = frameUniforms(state.camera, width, height, 0);
 
-    // Compile and link shaders
-    GLuint shaderProgram = createShaderProgram("vertex_shader.glsl", "fragment_shader.glsl");
+    // GPU time of the frames drawn while moving, what the quality levels are chosen by
+    GpuTimer gpuTimer;
+    double gpuMs = 0.0;
+
+    // The few samples of a fresh average are filtered with the first-hit
+    // features before they are shown
+    DenoisePass denoisePass(width, height);
+    DenoiseSettings denoiseSettings;
 
     // Variables for FPS calculation
     double lastTime = glfwGetTime();
     int nbFrames = 0;
 
+    // Time spent waiting for events because nothing needed drawing
+    double startTime = lastTime;
+    double idleSeconds = 0.0;
+    bool idle = false;
+
     // Main loop
     while (!glfwWindowShouldClose(window)) {
+        if (shaderWatcher.poll()) {
+            programs.beginReload();
+            denoiseProgram.beginReload("vertex_shader.glsl", "denoise_shader.glsl");
+            reprojectProgram.beginReload("vertex_shader.glsl", "reproject_shader.glsl");
+        }
+        if (denoiseProgram.finishReload()) {
+            std::cout << "Denoise shader reloaded" << std::endl;
+        }
+        if (reprojectProgram.finishReload()) {
+            reprojectProgram.bindUniformBlock("FrameBlock", FRAME_BLOCK_BINDING);
+            std::cout << "Reprojection shader reloaded" << std::endl;
+        }
+        // The camera stays, only the samples of the old shader are dropped
+        if (programs.finishReload()) {
+            accumulation.reset();
+            std::cout << "Shader reloaded" << std::endl;
+        }
+        // So does a sampling toggle, the pixels that had retired trace again
+        if (state.restart) {
+            accumulation.reset();
+            state.restart = false;
+        }
+
+        // A new window size starts a new average at that size. Minimized windows
+        // report 0 x 0 and keep the old targets.
+        if (state.resized) {
+            int newWidth, newHeight;
+            glfwGetFramebufferSize(window, &newWidth, &newHeight);
+            if (newWidth > 0 && newHeight > 0 && (newWidth != width || newHeight != height)) {
+                width = newWidth;
+                height = newHeight;
+                glViewport(0, 0, width, height);
+                accumulation.resize(width, height);
+                denoisePass.resize(width, height);
+                lastFrame = frameUniforms(state.camera, width, height, 0);
+            }
+            state.resized = false;
+        }
+
+        // While the camera is being dragged the quality drops as far as the frame
+        // budget needs, once it is left alone it climbs back to full quality
+        bool moving = state.camera_changed
+            || glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS
+            || glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+
+        // A still image at full quality is done once a finished frame traced no
+        // pixel. Until something changes the loop only waits for events, the
+        // last frame stays on screen.
+        GLuint tracedPixels;
+        bool converged = accumulation.tracedPixels(tracedPixels) && tracedPixels == 0;
+        bool reloading = programs.reloadPending() || denoiseProgram.reloadPending() || reprojectProgram.reloadPending();
+        if (!moving && !state.redraw && !reloading && converged && quality.atFullQuality()) {
+            if (!idle) {
+                std::string title = "Ray Tracing - Idle - Frames: " + std::to_string(accumulation.frameCount());
+                glfwSetWindowTitle(window, title.c_str());
+                idle = true;
+            }
+            double waitStart = glfwGetTime();
+            glfwWaitEventsTimeout(IDLE_POLL_SECONDS);
+            double waited = glfwGetTime() - waitStart;
+            idleSeconds += waited;
+            lastTime += waited; // the FPS counts drawing time only
+            continue;
+        }
+        idle = false;
+        state.redraw = false;
+
         // Measure the time
         double currentTime = glfwGetTime();
         nbFrames++;
@@ -206,14 +454,62 @@ int main() {
         // If one second has passed, update the window title with the FPS
         if (currentTime - lastTime >= 1.0) {
             int fps = double(nbFrames) / (currentTime - lastTime);
-            std::string title = "Ray Tracing - FPS: " + std::to_string(fps);
+            std::string title = "Ray Tracing - FPS: " + std::to_string(fps) + " - Frames: " + std::to_string(accumulation.frameCount())
+                + " - Resolution: " + std::to_string(accumulation.renderWidth()) + "x" + std::to_string(accumulation.renderHeight())
+                + " - GPU: " + std::to_string(int(gpuMs + 0.5)) + " ms";
             glfwSetWindowTitle(window, title.c_str());
             nbFrames = 0;
             lastTime = currentTime;
         }
 
-        // Render the scene
-        renderScene(shaderProgram, width, height, sphereBuffer, spheres.size(), camera);
+        int levelIndex = quality.choose(moving);
+        const QualityLevel& level = quality.level(levelIndex);
+        ShaderProgram* next = programs.get(permutationDefines(level, state.next_event, options));
+        int renderWidth = std::max(1, int(width * level.scale + 0.5f));
+        int renderHeight = std::max(1, int(height * level.scale + 0.5f));
+        bool resized = renderWidth != accumulation.renderWidth() || renderHeight != accumulation.renderHeight();
+        accumulation.setRenderSize(renderWidth, renderHeight);
+
+        // A moved camera or a new resolution keeps the average, reprojected to the
+        // new pixels. Switching samples or bounces keeps it too: the cheaper
+        // samples are only a share of it, and that share shrinks as full quality
+        // accumulates. The sequence index counts the samples actually traced, so
+        // no level reuses the points of another. A level that failed to build
+        // keeps the previous program, and its samples are counted.
+        bool reproject = (state.camera_changed || resized) && accumulation.frameCount() > 0;
+        state.camera_changed = false;
+        if (next) {
+            program = next;
+            programRays = level.rays_per_pixel;
+        }
+
+        // Render the scene. Only moving frames are timed, idle ones get cheaper
+        // as pixels converge and would make the levels look faster than they are.
+        gpuTimer.begin(moving ? levelIndex : -1);
+        renderScene(*program, fullscreenVao, renderWidth, renderHeight, programRays, scene, state.camera, targetError, WINDOW_MAX_SAMPLES, reproject, frameBlock, accumulation);
+        if (reproject) {
+            reprojectHistory(reprojectProgram, fullscreenVao, lastFrame, accumulation);
+        }
+        lastFrame = frameUniforms(state.camera, renderWidth, renderHeight, 0);
+        if (state.denoise) {
+            denoisePass.run(denoiseProgram, fullscreenVao, accumulation, denoiseSettings);
+        }
+        gpuTimer.end();
+
+        if (state.denoise) {
+            denoisePass.present(width, height);
+        } else {
+            accumulation.present(width, height);
+        }
+
+        double timedMs;
+        int timedLevel;
+        while (gpuTimer.poll(timedMs, timedLevel)) {
+            gpuMs = timedMs;
+            if (timedLevel >= 0) {
+                quality.record(timedLevel, timedMs);
+            }
+        }
 
         // Swap buffers
         glfwSwapBuffers(window);
@@ -222,8 +518,20 @@ int main() {
         glfwPollEvents();
     }
 
+    double totalSeconds = glfwGetTime() - startTime;
+    std::cout << "Active " << totalSeconds - idleSeconds << " s, idle " << idleSeconds << " s ("
+              << int(100.0 * idleSeconds / std::max(totalSeconds, 1e-6) + 0.5) << "% idle)" << std::endl;
+
     // Cleanup
-    glDeleteProgram(shaderProgram);
+    gpuTimer.destroy();
+    denoisePass.destroy();
+    accumulation.destroy();
+    scene.destroy();
+    frameBlock.destroy();
+    glDeleteVertexArrays(1, &fullscreenVao);
+    reprojectProgram.destroy();
+    denoiseProgram.destroy();
+    programs.destroy();
     glfwDestroyWindow(window);
     glfwTerminate();
     return 0;
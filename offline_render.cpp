@@ -0,0 +1,213 @@
+#include "offline_render.h"
+#include "bvh.h"
+#include "cpu_tracer.h"
+#include "denoiser.h"
+#include "image_io.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "sphere_soa.h"
+#include "thread_pool.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using std::vector;
+using glm::vec3;
+
+bool parseOfflineOptions(int argc, char** argv, OfflineOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (std::strcmp(arg, "--headless") == 0)
+            options.headless = true;
+        else if (std::strcmp(arg, "--width") == 0 && hasValue)
+            options.width = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--height") == 0 && hasValue)
+            options.height = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--spp") == 0 && hasValue)
+            options.samples_per_pixel = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--target-error") == 0 && hasValue)
+            options.target_error = static_cast<float>(std::atof(argv[++i]));
+        else if (std::strcmp(arg, "--bounces") == 0 && hasValue)
+            options.max_bounce = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--rr-depth") == 0 && hasValue)
+            options.rr_min_depth = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--no-nee") == 0)
+            options.next_event = false;
+        else if (std::strcmp(arg, "--threads") == 0 && hasValue)
+            options.threads = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--spheres") == 0 && hasValue)
+            options.extra_spheres = std::atoi(argv[++i]);
+        else if (std::strcmp(arg, "--no-bvh") == 0)
+            options.use_bvh = false;
+        else if (std::strcmp(arg, "--denoise") == 0)
+            options.denoise = true;
+        else if (std::strcmp(arg, "--frame-budget") == 0 && hasValue)
+            options.frame_budget_ms = static_cast<float>(std::atof(argv[++i]));
+        else if (std::strcmp(arg, "--sampler") == 0 && hasValue)
+            options.sampler = argv[++i];
+        else if (std::strcmp(arg, "--simd") == 0 && hasValue)
+            options.simd_level = argv[++i];
+        else if (std::strcmp(arg, "--scene") == 0 && hasValue)
+            options.scene_path = argv[++i];
+        else if (std::strcmp(arg, "--convert") == 0 && i + 2 < argc)
+        {
+            options.convert_input = argv[++i];
+            options.convert_output = argv[++i];
+        }
+        else if (std::strcmp(arg, "--out") == 0 && hasValue)
+            options.output = argv[++i];
+        else
+        {
+            std::cerr << "Unknown or incomplete argument: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.width <= 0 || options.height <= 0 || options.samples_per_pixel <= 0 || options.max_bounce < 0 || options.rr_min_depth < 1)
+    {
+        std::cerr << "Resolution, samples per pixel and Russian roulette depth must be positive" << std::endl;
+        return false;
+    }
+
+    if (options.target_error < 0.0f || options.frame_budget_ms < 0.0f || options.threads < 0)
+    {
+        std::cerr << "Target error, frame budget and thread count must not be negative" << std::endl;
+        return false;
+    }
+
+    // A typo in the output name must not cost a whole render
+    if (options.convert_input.empty() && !imageFormatSupported(options.output))
+    {
+        std::cerr << "Unknown image format: " << options.output << " (use .png, .pfm or .exr)" << std::endl;
+        return false;
+    }
+
+    SamplerType sampler;
+    if (!parseSamplerType(options.sampler.c_str(), sampler))
+    {
+        std::cerr << "Unknown sampler: " << options.sampler << std::endl;
+        return false;
+    }
+
+    SimdLevel level;
+    if (!options.simd_level.empty() && !parseSimdLevel(options.simd_level.c_str(), level))
+    {
+        std::cerr << "Unknown SIMD level: " << options.simd_level << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void printOfflineUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [--headless] [options]\n"
+              << "       " << program << " --convert SCENE.txt SCENE.rtscene\n"
+              << "  --headless        render on the CPU without opening a window\n"
+              << "  --width N         image width (default 1200)\n"
+              << "  --height N        image height (default 900)\n"
+              << "  --spp N           samples per pixel (default 64)\n"
+              << "  --target-error E  stop sampling pixels whose noise fell below E, e.g. 0.01;\n"
+              << "                    --spp becomes the limit (default 0 = fixed spp)\n"
+              << "  --bounces N       maximum bounces per path (default 8)\n"
+              << "  --rr-depth N      bounces before Russian roulette, >= bounces turns it off (default 3)\n"
+              << "  --no-nee          only find lights by bouncing into them\n"
+              << "  --threads N       worker threads, 0 = every core (default 0)\n"
+              << "  --spheres N       add N random spheres to the scene\n"
+              << "  --no-bvh          test every sphere for every ray\n"
+              << "  --denoise         run the edge-avoiding A-trous filter over the image\n"
+              << "  --frame-budget MS window only: GPU time per frame to hold while the camera\n"
+              << "                    moves, by lowering resolution, spp and bounces (default 16.6, 0 = off)\n"
+              << "  --sampler NAME    pcg (random) or sobol (scrambled Sobol, default)\n"
+              << "  --simd LEVEL      scalar, sse4.2, avx2 or avx512 (default: best supported)\n"
+              << "  --scene FILE      load a binary scene file instead of the built-in scene\n"
+              << "  --convert IN OUT  convert a text scene description to a binary scene file\n"
+              << "  --out FILE        output image, .png, .pfm or .exr (default render.png)" << std::endl;
+}
+
+int runOfflineRender(const OfflineOptions& options)
+{
+    auto loadStart = std::chrono::steady_clock::now();
+    SceneData scene;
+    if (!loadScene(options.scene_path, options.extra_spheres, options.use_bvh, scene))
+        return -1;
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    std::cout << "Scene: " << scene.sphere_count << " spheres, loaded in " << loadMs << " ms" << std::endl;
+
+    if (options.use_bvh)
+    {
+        const BvhStats& stats = scene.bvh.getStats();
+        std::cout << "BVH: " << scene.sphere_count << " spheres, " << stats.node_count << " nodes ("
+                  << stats.leaf_count << " leaves, depth " << stats.max_depth << "), "
+                  << stats.node_bytes / 1024.0 << " KB, built in " << stats.build_ms << " ms" << std::endl;
+    }
+
+    SimdLevel level = detectSimdLevel();
+    if (!options.simd_level.empty())
+        parseSimdLevel(options.simd_level.c_str(), level);
+    level = setSimdLevel(level);
+
+    ThreadPool pool(static_cast<unsigned int>(options.threads));
+    CpuTracer tracer(scene.spheres, scene.sphere_count, options.use_bvh ? &scene.bvh : nullptr, pool);
+    Camera camera = scene.camera;
+
+    RenderSettings settings;
+    settings.width = options.width;
+    settings.height = options.height;
+    settings.rays_per_pixel = options.samples_per_pixel;
+    settings.max_bounce = options.max_bounce;
+    settings.rr_min_depth = options.rr_min_depth;
+    settings.next_event = options.next_event;
+    settings.frame_index = 0;
+    parseSamplerType(options.sampler.c_str(), settings.sampler);
+
+    std::cout << "Rendering " << options.width << "x" << options.height << " at "
+              << (options.target_error > 0.0f ? "up to " : "") << options.samples_per_pixel << " spp on "
+              << pool.size() << " threads (" << simdLevelName(level) << ", " << options.sampler << " sampler)" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    vector<vec3> image;
+    DenoiseFeatures features;
+    DenoiseFeatures* featuresOut = options.denoise ? &features : nullptr;
+    double samplesPerPixel = options.samples_per_pixel;
+    if (options.target_error > 0.0f)
+    {
+        // Flat regions stop early, the budget goes to the noisy ones
+        AdaptiveStats stats = tracer.renderAdaptive(camera, settings, options.target_error, image, featuresOut);
+        samplesPerPixel = stats.average_spp;
+        std::cout << "Adaptive: " << stats.passes << " passes, " << stats.average_spp << " spp on average, "
+                  << stats.converged_share * 100.0 << "% of pixels below " << options.target_error << std::endl;
+    }
+    else
+    {
+        tracer.render(camera, settings, image, featuresOut);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double samples = double(options.width) * options.height * samplesPerPixel;
+    std::cout << "Render time: " << seconds << " s (" << samples / seconds / 1e6 << " Msamples/s)" << std::endl;
+
+    if (options.denoise)
+    {
+        auto denoiseStart = std::chrono::steady_clock::now();
+        vector<vec3> filtered;
+        denoiseImage(image, features, options.width, options.height, DenoiseSettings(), pool, filtered);
+        image.swap(filtered);
+        double denoiseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - denoiseStart).count();
+        std::cout << "Denoise time: " << denoiseMs << " ms" << std::endl;
+    }
+
+    if (!writeImage(options.output, image, options.width, options.height))
+    {
+        std::cerr << "Failed to write image: " << options.output << std::endl;
+        return -1;
+    }
+
+    std::cout << "Wrote " << options.output << std::endl;
+    return 0;
+}
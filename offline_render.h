@@ -0,0 +1,40 @@
+#ifndef OFFLINE_RENDER_H
+#define OFFLINE_RENDER_H
+
+#include <string>
+
+struct OfflineOptions
+{
+    bool headless = false;
+    int width = 1200;
+    int height = 900;
+    int samples_per_pixel = 64;   // with target_error the most a pixel may take
+    float target_error = 0.0f;    // stop sampling a pixel below this error, 0 = every pixel gets every sample
+                                  // (the window then uses its own default)
+    int max_bounce = 8;       // also the final quality of the window
+    int rr_min_depth = 3;     // bounces before Russian roulette may end a path, also used by the window
+    bool next_event = true;   // sample the lights at every bounce, also used by the window
+    int threads = 0;          // 0 = every core
+    int extra_spheres = 0;    // random spheres added to the scene
+    bool use_bvh = true;
+    bool denoise = false;     // filter the image with the first-hit normals, depths and albedos
+    float frame_budget_ms = 16.6f; // the window lowers its quality while moving to stay under this, 0 = off
+    std::string simd_level;     // intersection kernels, empty = best the CPU supports
+    std::string sampler = "sobol"; // pcg or sobol, also used by the window
+    std::string scene_path;     // binary scene file, empty = built-in scene
+    std::string convert_input;  // text scene to convert, the program exits afterwards
+    std::string convert_output;
+    std::string output = "render.png";
+};
+
+// Function to parse the command line, returns false on bad arguments
+bool parseOfflineOptions(int argc, char** argv, OfflineOptions& options);
+
+// Function to print the command line help
+void printOfflineUsage(const char* program);
+
+// Function to render the scene on the CPU and write it to disk. No window or GL
+// context is created. Returns the process exit code.
+int runOfflineRender(const OfflineOptions& options);
+
+#endif // OFFLINE_RENDER_H
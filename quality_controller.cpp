@@ -0,0 +1,146 @@
+#include "quality_controller.h"
+#include <algorithm>
+#include <cstdlib>
+
+using std::vector;
+
+// Share of the budget a better level must be predicted under before a moving
+// view switches to it, so it does not flip between two levels every frame
+#define QUALITY_HEADROOM 0.85
+// Frames an idle view stays at a level before it steps up to the next better one
+#define QUALITY_RAMP_FRAMES 4
+// Weight of a new measurement in a level's smoothed time
+#define QUALITY_SMOOTHING 0.25
+
+// Resolutions tried once samples and bounces are at their minimum
+static const float LADDER_SCALES[] = { 0.75f, 0.5f, 0.35f, 0.25f };
+
+vector<QualityLevel> qualityLadder(int raysPerPixel, int maxBounce, int minRaysPerPixel, int minBounce)
+{
+    minRaysPerPixel = std::min(minRaysPerPixel, raysPerPixel);
+    minBounce = std::min(minBounce, maxBounce);
+
+    vector<QualityLevel> ladder;
+    for (int rays = raysPerPixel; rays > minRaysPerPixel; rays /= 2)
+        ladder.push_back({ 1.0f, rays, maxBounce });
+    for (int bounce = maxBounce; bounce > minBounce; bounce /= 2)
+        ladder.push_back({ 1.0f, minRaysPerPixel, bounce });
+    ladder.push_back({ 1.0f, minRaysPerPixel, minBounce });
+    for (float scale : LADDER_SCALES)
+        ladder.push_back({ scale, minRaysPerPixel, minBounce });
+    return ladder;
+}
+
+// Rough relative cost of a level, only its ratio to another level's is used
+static double levelCost(const QualityLevel& level)
+{
+    return double(level.scale) * level.scale * level.rays_per_pixel * std::max(level.max_bounce, 1);
+}
+
+QualityController::QualityController(const vector<QualityLevel>& levels, double budgetMs)
+    : levels(levels), measured(levels.size(), 0.0), budget(budgetMs), current(0), idle_frames(0)
+{
+}
+
+double QualityController::predict(int level) const
+{
+    if (measured[level] > 0.0)
+        return measured[level];
+
+    int nearest = -1;
+    for (int i = 0; i < levelCount(); i++)
+    {
+        if (measured[i] > 0.0 && (nearest < 0 || std::abs(i - level) < std::abs(nearest - level)))
+            nearest = i;
+    }
+    if (nearest < 0)
+        return 0.0;
+    return measured[nearest] * levelCost(levels[level]) / levelCost(levels[nearest]);
+}
+
+int QualityController::choose(bool moving)
+{
+    if (budget <= 0.0)
+        return current = 0;
+
+    if (!moving)
+    {
+        if (current > 0 && ++idle_frames >= QUALITY_RAMP_FRAMES)
+        {
+            current--;
+            idle_frames = 0;
+        }
+        return current;
+    }
+
+    // The best level predicted to fit, better ones than the current need headroom
+    idle_frames = 0;
+    int chosen = levelCount() - 1;
+    for (int i = 0; i < levelCount(); i++)
+    {
+        double limit = i < current ? budget * QUALITY_HEADROOM : budget;
+        if (predict(i) <= limit)
+        {
+            chosen = i;
+            break;
+        }
+    }
+    return current = chosen;
+}
+
+void QualityController::record(int level, double milliseconds)
+{
+    if (measured[level] > 0.0)
+        measured[level] += (milliseconds - measured[level]) * QUALITY_SMOOTHING;
+    else
+        measured[level] = milliseconds;
+}
+
+GpuTimer::GpuTimer()
+    : oldest(0), pending(0), running(false)
+{
+    glGenQueries(GPU_TIMER_QUERIES, queries);
+}
+
+void GpuTimer::destroy()
+{
+    glDeleteQueries(GPU_TIMER_QUERIES, queries);
+}
+
+void GpuTimer::begin(int tag)
+{
+    running = pending < GPU_TIMER_QUERIES;
+    if (!running)
+        return;
+    int slot = (oldest + pending) % GPU_TIMER_QUERIES;
+    tags[slot] = tag;
+    glBeginQuery(GL_TIME_ELAPSED, queries[slot]);
+}
+
+void GpuTimer::end()
+{
+    if (!running)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    pending++;
+    running = false;
+}
+
+bool GpuTimer::poll(double& milliseconds, int& tag)
+{
+    if (pending == 0)
+        return false;
+
+    GLint available = 0;
+    glGetQueryObjectiv(queries[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return false;
+
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(queries[oldest], GL_QUERY_RESULT, &nanoseconds);
+    milliseconds = double(nanoseconds) * 1e-6;
+    tag = tags[oldest];
+    oldest = (oldest + 1) % GPU_TIMER_QUERIES;
+    pending--;
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef QUALITY_CONTROLLER_H
+#define QUALITY_CONTROLLER_H
+
+#include <GL/glew.h>
+#include <vector>
+
+// One step of the window's quality ladder
+struct QualityLevel
+{
+    float scale;        // render resolution relative to the window, per axis
+    int rays_per_pixel;
+    int max_bounce;
+};
+
+// Function to build the ladder from full quality down: first fewer samples,
+// then fewer bounces, then lower resolutions
+std::vector<QualityLevel> qualityLadder(int raysPerPixel, int maxBounce, int minRaysPerPixel, int minBounce);
+
+// Picks the quality level of each frame so the GPU time stays under a budget
+// while the camera moves. Every level keeps a smoothed time of its own frames.
+// Levels not timed yet are predicted from the nearest timed one, scaled by
+// pixels x samples x bounces. An idle view climbs back to full quality one
+// level at a time, whatever it costs, because it is accumulating.
+class QualityController
+{
+public:
+    // A budget of 0 keeps full quality
+    QualityController(const std::vector<QualityLevel>& levels, double budgetMs);
+
+    // Function to choose the level of the next frame
+    int choose(bool moving);
+
+    // Function to record how long a frame at a level took on the GPU
+    void record(int level, double milliseconds);
+
+    const QualityLevel& level(int index) const { return levels[index]; }
+    int levelCount() const { return static_cast<int>(levels.size()); }
+
+    // True once the choices have climbed back to the top of the ladder
+    bool atFullQuality() const { return current == 0; }
+
+private:
+    // Function to estimate a level's frame time, 0 if nothing was timed yet
+    double predict(int level) const;
+
+    std::vector<QualityLevel> levels;
+    std::vector<double> measured; // smoothed GPU time per level, 0 until one was timed
+    double budget;
+    int current;
+    int idle_frames; // frames since the last step up while idle
+};
+
+// Number of timer queries in flight, results arrive a few frames late
+#define GPU_TIMER_QUERIES 4
+
+// Measures the GPU time of a frame's commands with timer queries. The results
+// are collected without waiting, each with the tag it was started with.
+class GpuTimer
+{
+public:
+    GpuTimer();
+
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator=(const GpuTimer&) = delete;
+
+    // Function to delete the queries, must run while the context is still alive
+    void destroy();
+
+    // Function to start timing. If every query is still waiting for its result
+    // the frame is not timed.
+    void begin(int tag);
+
+    void end();
+
+    // Function to get the oldest finished measurement, false if none finished
+    bool poll(double& milliseconds, int& tag);
+
+private:
+    GLuint queries[GPU_TIMER_QUERIES];
+    int tags[GPU_TIMER_QUERIES];
+    int oldest;  // query whose result is collected next
+    int pending; // queries issued and not collected
+    bool running;
+};
+
+#endif // QUALITY_CONTROLLER_H
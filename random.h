@@ -0,0 +1,33 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// PCG random numbers (RXS-M-XS, 32 bit state). fragment_shader.glsl has the same
+// functions, so both tracers draw bit-identical streams.
+
+// Function to scramble a value into a well distributed 32-bit hash
+inline uint32_t pcgHash(uint32_t value)
+{
+    uint32_t state = value * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Function to start an independent stream for one sample of one pixel in one frame
+inline uint32_t rngSeed(uint32_t x, uint32_t y, uint32_t frame, uint32_t sample)
+{
+    return pcgHash(x + pcgHash(y + pcgHash(frame + pcgHash(sample))));
+}
+
+// Function to advance the stream and get a uniform value in [0, 1)
+inline float randomFloat(uint32_t& state)
+{
+    state = state * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    word = (word >> 22u) ^ word;
+    // The top 24 bits convert to float exactly
+    return float(word >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif // RANDOM_H
@@ -0,0 +1,36 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include "scene.h"
+#include <glm/glm.hpp>
+#include <cmath>
+
+// Distance reported when nothing is hit, same value the shader uses
+#define NO_HIT 1000000.0f
+
+struct Ray
+{
+    glm::vec3 origin;
+    glm::vec3 dir;
+};
+
+// Function to get the distance to a sphere along the ray, NO_HIT if it is missed.
+// Only the near root counts, like hit_sphere in the shader.
+inline float intersectSphere(const Ray& ray, const Sphere& sphere)
+{
+    glm::vec3 oc = ray.origin - sphere.center;
+    float a = glm::dot(ray.dir, ray.dir);
+    float b = 2.0f * glm::dot(oc, ray.dir);
+    float c = glm::dot(oc, oc) - sphere.radius * sphere.radius;
+    float discriminant = b * b - 4 * a * c;
+
+    if (discriminant > 0)
+    {
+        float temp = (-b - std::sqrt(discriminant)) / (2.0f * a);
+        if (temp < NO_HIT && temp > 0.0001f)
+            return temp;
+    }
+    return NO_HIT;
+}
+
+#endif // RAY_H
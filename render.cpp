@@ -0,0 +1,20 @@
+#include "offline_render.h"
+#include "scene_file.h"
+
+// Command line renderer for machines without a display or GL libraries. It takes
+// the same options as the window app and always renders on the CPU, so
+// --headless is implied.
+int main(int argc, char** argv)
+{
+    OfflineOptions options;
+    if (!parseOfflineOptions(argc, argv, options))
+    {
+        printOfflineUsage(argv[0]);
+        return -1;
+    }
+
+    if (!options.convert_input.empty())
+        return convertSceneText(options.convert_input, options.convert_output) ? 0 : -1;
+
+    return runOfflineRender(options);
+}
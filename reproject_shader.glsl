@@ -0,0 +1,160 @@
+#version 430 core
+// Reprojection pass. While the camera moves or the resolution changes, each
+// frame is traced on its own and this pass blends in the average the previous
+// camera saw: the pixel's first hit is projected into the previous view, and the
+// history there is kept where it shows the same surface, clamped to the colors
+// this frame found around the pixel.
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec2 FragMoments;
+layout(location = 2) out vec4 FragNormalDepth;
+layout(location = 3) out vec4 FragAlbedo;
+
+// The camera of the frame just traced
+layout(std140) uniform FrameBlock {
+    vec3 camera_center;
+    int width;
+    vec3 pixel00_loc;
+    int height;
+    vec3 pixel_delta_u;
+    int frameIndex;
+    vec3 pixel_delta_v;
+};
+
+// Average from before the camera moved, same layout as the accumulation targets
+uniform sampler2D historyColor;
+uniform sampler2D historyMoments; // mean squared luminance and sample count, the history length
+uniform sampler2D historyNormalDepth;
+uniform sampler2D historyAlbedo;
+
+// The frame just traced
+uniform sampler2D frameColor;
+uniform sampler2D frameMoments;
+uniform sampler2D frameNormalDepth;
+uniform sampler2D frameAlbedo;
+
+// Ray setup constants of the camera the history was rendered with
+uniform vec3 previousCameraCenter;
+uniform vec3 previousPixel00;
+uniform vec3 previousDeltaU;
+uniform vec3 previousDeltaV;
+uniform ivec2 previousSize; // the history's resolution, it may differ from this frame's
+
+// Longest history a moving pixel keeps, in samples, so what reprojection gets
+// wrong fades out instead of trailing behind the camera
+#define MAX_HISTORY_SAMPLES 64.0
+// Relative difference of the distances up to which history shows the same surface
+#define DEPTH_TOLERANCE 0.05
+// Smallest dot product of the averaged normals for the same
+#define NORMAL_TOLERANCE 0.8
+// Half width of the color box the history is clamped to, in standard deviations
+#define CLAMP_SIGMA 2.0
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Function to find where the previous camera saw a direction, in pixels of the
+// previous image. False if it points away from the previous viewport.
+bool previous_pixel(vec3 dir, out vec2 position)
+{
+    // The viewport is the plane through pixel00 spanned by the pixel deltas
+    vec3 normal = cross(previousDeltaU, previousDeltaV);
+    float t = dot(previousPixel00 - previousCameraCenter, normal) / dot(dir, normal);
+    vec3 offset = previousCameraCenter + dir * t - previousPixel00;
+    position = vec2(dot(offset, previousDeltaU) / dot(previousDeltaU, previousDeltaU),
+                    dot(offset, previousDeltaV) / dot(previousDeltaV, previousDeltaV));
+    return t > 0.0;
+}
+
+// Function to check whether a history texel shows the surface the pixel hit now.
+// Background stays background.
+bool same_surface(vec4 history, vec4 current, float expectedDepth)
+{
+    if (current.w == 0.0)
+    {
+        return history.w == 0.0;
+    }
+    return abs(history.w - expectedDepth) < DEPTH_TOLERANCE * expectedDepth
+        && dot(history.xyz, current.xyz) > NORMAL_TOLERANCE;
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec3 color = texelFetch(frameColor, pixel, 0).rgb;
+    vec2 moments = texelFetch(frameMoments, pixel, 0).xy;
+    vec4 normalDepth = texelFetch(frameNormalDepth, pixel, 0);
+    vec4 albedo = texelFetch(frameAlbedo, pixel, 0);
+
+    // The first hit lies its distance along the ray through the pixel center.
+    // The previous camera sees it from where it stood, and the background in the
+    // same direction as now.
+    vec3 pixelCenter = pixel00_loc + float(pixel.x) * pixel_delta_u + float(pixel.y) * pixel_delta_v;
+    vec3 dir = normalize(pixelCenter - camera_center);
+    vec3 previousDir = normalDepth.w > 0.0 ? camera_center + dir * normalDepth.w - previousCameraCenter : dir;
+
+    // Bilinear lookup that leaves out the texels showing another surface
+    vec3 history = vec3(0, 0, 0);
+    vec2 historyStats = vec2(0, 0);
+    float weightSum = 0.0;
+    vec2 position;
+    if (previous_pixel(previousDir, position))
+    {
+        ivec2 base = ivec2(floor(position));
+        vec2 f = position - vec2(base);
+        for (int i = 0; i < 4; i++)
+        {
+            ivec2 tap = base + ivec2(i & 1, i >> 1);
+            float weight = ((i & 1) != 0 ? f.x : 1.0 - f.x) * ((i >> 1) != 0 ? f.y : 1.0 - f.y);
+            if (weight <= 0.0 || any(lessThan(tap, ivec2(0))) || any(greaterThanEqual(tap, previousSize)))
+                continue;
+            if (!same_surface(texelFetch(historyNormalDepth, tap, 0), normalDepth, length(previousDir)))
+                continue;
+            history += weight * texelFetch(historyColor, tap, 0).rgb;
+            historyStats += weight * texelFetch(historyMoments, tap, 0).xy;
+            weightSum += weight;
+        }
+    }
+
+    if (weightSum > 0.01)
+    {
+        history /= weightSum;
+        historyStats /= weightSum;
+
+        // Clamp the history to the box of colors this frame found around the
+        // pixel, widened by how far the box's mean may be off with this few
+        // samples, so noise alone does not cut converged history
+        vec3 mean = vec3(0, 0, 0);
+        vec3 square = vec3(0, 0, 0);
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                ivec2 neighbour = clamp(pixel + ivec2(dx, dy), ivec2(0), ivec2(width - 1, height - 1));
+                vec3 c = texelFetch(frameColor, neighbour, 0).rgb;
+                mean += c;
+                square += c * c;
+            }
+        }
+        mean /= 9.0;
+        square /= 9.0;
+        float historyLum = luminance(history);
+        float sampleSigma = sqrt(max(historyStats.x - historyLum * historyLum, 0.0));
+        vec3 extent = CLAMP_SIGMA * (sqrt(max(square - mean * mean, vec3(0.0))) + sampleSigma / sqrt(9.0 * moments.y));
+        history = clamp(history, mean - extent, mean + extent);
+
+        // The history length shrinks with the share of the lookup that matched
+        float historySamples = min(historyStats.y, MAX_HISTORY_SAMPLES) * weightSum;
+        float samples = historySamples + moments.y;
+        float weight = moments.y / samples;
+        color = history + (color - history) * weight;
+        moments = vec2(historyStats.x + (moments.x - historyStats.x) * weight, samples);
+    }
+
+    // The features stay this frame's, the history's were measured from the old camera
+    FragColor = vec4(color, 1.0);
+    FragMoments = moments;
+    FragNormalDepth = normalDepth;
+    FragAlbedo = albedo;
+}
@@ -0,0 +1,123 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "random.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cstring>
+
+// Sample generators for the path dimensions. Every call to sample2D() hands out
+// the next pair of dimensions: the first pair jitters the pixel, then one pair per
+// bounce. fragment_shader.glsl has the same functions, selected with SAMPLER.
+enum class SamplerType
+{
+    PCG = 0,   // independent random numbers
+    Sobol = 1  // Owen-scrambled Sobol points, converges faster
+};
+
+// Function to parse pcg or sobol, returns false for anything else
+inline bool parseSamplerType(const char* name, SamplerType& type)
+{
+    if (std::strcmp(name, "pcg") == 0)
+        type = SamplerType::PCG;
+    else if (std::strcmp(name, "sobol") == 0)
+        type = SamplerType::Sobol;
+    else
+        return false;
+    return true;
+}
+
+struct Sampler
+{
+    SamplerType type;
+    uint32_t rng;       // PCG: the stream state
+    uint32_t seed;      // Sobol: per-pixel scrambling seed
+    uint32_t index;     // Sobol: index of the sample in the pixel's sequence
+    uint32_t dimension; // Sobol: next pair of dimensions
+};
+
+inline uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Function to apply a hash-based Owen scramble: every bit is flipped depending
+// on the bits above it (Laine-Karras permutation, Burley 2020)
+inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// First two Sobol dimensions. Both are (0, 2)-sequences in base 2, so every
+// power-of-two prefix stratifies the unit square.
+inline uint32_t sobolDim0(uint32_t index)
+{
+    return reverseBits(index);
+}
+
+inline uint32_t sobolDim1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1u)
+            result ^= v;
+    }
+    return result;
+}
+
+// Function to start the sampler for one sample of a pixel. firstSample is the
+// number of samples the pixel was handed in earlier frames, so progressive
+// accumulation keeps walking the same sequence and never reuses a point, even
+// when the samples per frame change along the way.
+inline Sampler makeSampler(SamplerType type, uint32_t x, uint32_t y, uint32_t frame, uint32_t sampleInFrame, uint32_t firstSample)
+{
+    Sampler sampler;
+    sampler.type = type;
+    sampler.rng = rngSeed(x, y, frame, sampleInFrame);
+    sampler.seed = pcgHash(x + pcgHash(y));
+    sampler.index = firstSample + sampleInFrame;
+    sampler.dimension = 0;
+    return sampler;
+}
+
+// Function to get the next two dimensions of the sample in [0, 1)
+inline glm::vec2 sample2D(Sampler& sampler)
+{
+    if (sampler.type == SamplerType::PCG)
+    {
+        float u = randomFloat(sampler.rng);
+        return glm::vec2(u, randomFloat(sampler.rng));
+    }
+
+    // Each pair gets its own shuffle of the sequence so pairs stay uncorrelated
+    uint32_t pairSeed = pcgHash(sampler.seed + pcgHash(sampler.dimension++));
+    uint32_t index = owenScramble(sampler.index, pairSeed);
+    uint32_t x = owenScramble(sobolDim0(index), pcgHash(pairSeed + 1u));
+    uint32_t y = owenScramble(sobolDim1(index), pcgHash(pairSeed + 2u));
+    return glm::vec2(float(x >> 8), float(y >> 8)) * (1.0f / 16777216.0f);
+}
+
+// Function to get the next single dimension of the sample in [0, 1). Sobol spends
+// a whole pair on it, so later dimensions stay the same whether or not it is used.
+inline float sample1D(Sampler& sampler)
+{
+    if (sampler.type == SamplerType::PCG)
+        return randomFloat(sampler.rng);
+
+    uint32_t pairSeed = pcgHash(sampler.seed + pcgHash(sampler.dimension++));
+    uint32_t index = owenScramble(sampler.index, pairSeed);
+    return float(owenScramble(sobolDim0(index), pcgHash(pairSeed + 1u)) >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif // SAMPLER_H
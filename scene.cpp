@@ -0,0 +1,77 @@
+#include "scene.h"
+#include <random>
+
+using std::vector;
+using glm::vec3;
+
+vector<Sphere> spheresSetup()
+{
+    Sphere sun = { vec3(50.0f, -101.0f, -105.0f), 100.0f, vec3(0.0f, 0.0f, 1.0f), 5.0f, vec3(1.0f, 1.0f, 1.0f),  0.5f };
+
+    // Create a vector for the spheres
+    vector<Sphere> spheres = {
+        {vec3(0.0f, 0.0f, -3.0f), 1.0f, vec3(1.0f, 0.0f, 0.0f), 0.0f, vec3(0, 0, 0),  0.0f},
+        {vec3(-1.5f, 0.0f, -2.0f), 0.5f, vec3(1.0f, 1.0f, 0.0f), 0.0f, vec3(0, 0, 0),  0.0f},
+        {vec3(-2.0f, 10.5f, -4.0f), 10.0f, vec3(0.5f, 0.0f, 0.5f), 0.0f, vec3(0, 0, 0),  0.0f},
+    };
+
+    spheres.push_back(sun);
+    return spheres;
+}
+
+void addRandomSpheres(vector<Sphere>& spheres, int count, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    spheres.reserve(spheres.size() + count);
+    for (int i = 0; i < count; i++)
+    {
+        vec3 center = vec3(-10.0f + 20.0f * unit(rng), -2.0f + 4.0f * unit(rng), -4.0f - 26.0f * unit(rng));
+        float radius = 0.05f + 0.2f * unit(rng);
+        vec3 color = vec3(unit(rng), unit(rng), unit(rng));
+        spheres.push_back({ center, radius, color, 0.0f, vec3(0, 0, 0), 0.0f });
+    }
+}
+
+vector<int> findLights(const Sphere* spheres, int count)
+{
+    vector<int> lights;
+    for (int i = 0; i < count; i++)
+    {
+        if (isEmissive(spheres[i]))
+            lights.push_back(i);
+    }
+    return lights;
+}
+
+FrameUniforms frameUniforms(const Camera& camera, int width, int height, int frameIndex)
+{
+    float viewport_height = camera.viewport_height;
+    float viewport_width = viewport_height * (float(width) / height);
+
+    vec3 viewport_u = vec3(viewport_width, 0, 0);
+    vec3 viewport_v = vec3(0, -viewport_height, 0);
+
+    vec3 pixel_delta_u = viewport_u / float(width);
+    vec3 pixel_delta_v = viewport_v / float(height);
+
+    vec3 viewport_upper_left = camera.camera_center - vec3(0, 0, camera.focal_length) - viewport_u / 2.0f - viewport_v / 2.0f;
+
+    FrameUniforms frame;
+    frame.camera_center = camera.camera_center;
+    frame.width = width;
+    frame.pixel00_loc = viewport_upper_left + 0.5f * (pixel_delta_u + pixel_delta_v);
+    frame.height = height;
+    frame.pixel_delta_u = pixel_delta_u;
+    frame.frame_index = frameIndex;
+    frame.pixel_delta_v = pixel_delta_v;
+    frame.padding = 0;
+    return frame;
+}
+
+Camera cameraSetup()
+{
+    Camera camera = { vec3(0.0f, 0.0f, 0.0f), 1.0f, 2.0f };
+    return camera;
+}
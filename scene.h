@@ -0,0 +1,67 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <glm/glm.hpp>
+#include <vector>
+
+// Layout matches the std140 Sphere struct in fragment_shader.glsl (48 bytes)
+struct Material
+{
+    glm::vec3 color;
+    float emission_strength;
+    glm::vec3 emmision_color;
+    float reflection_strength;
+};
+
+struct Sphere
+{
+    glm::vec3 center;
+    float radius;
+    Material material;
+};
+
+struct Camera
+{
+    glm::vec3 camera_center;
+    float focal_length;
+    float viewport_height;
+};
+
+// Per-frame ray setup constants, computed once instead of for every pixel. Layout
+// matches the std140 FrameBlock in fragment_shader.glsl, the ints fill the padding
+// after each vec3.
+struct FrameUniforms
+{
+    glm::vec3 camera_center;
+    int width;
+    glm::vec3 pixel00_loc; // center of the top left pixel on the viewport
+    int height;
+    glm::vec3 pixel_delta_u;
+    int frame_index;
+    glm::vec3 pixel_delta_v;
+    int padding;
+};
+
+// Function to compute the ray setup constants of a camera for an image size
+FrameUniforms frameUniforms(const Camera& camera, int width, int height, int frameIndex);
+
+// Function to create the default scene
+std::vector<Sphere> spheresSetup();
+
+// Function to scatter small random spheres in front of the camera, for stress tests
+void addRandomSpheres(std::vector<Sphere>& spheres, int count, unsigned int seed);
+
+// Function to check whether a sphere gives off light, those are sampled directly
+inline bool isEmissive(const Sphere& sphere)
+{
+    glm::vec3 emission = sphere.material.emission_strength * sphere.material.emmision_color;
+    return emission.r > 0.0f || emission.g > 0.0f || emission.b > 0.0f;
+}
+
+// Function to collect the indices of the emissive spheres, in array order
+std::vector<int> findLights(const Sphere* spheres, int count);
+
+// Function to create the default camera
+Camera cameraSetup();
+
+#endif // SCENE_H
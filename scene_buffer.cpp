@@ -0,0 +1,116 @@
+#include "scene_buffer.h"
+#include <algorithm>
+#include <iostream>
+
+SceneBuffer::SceneBuffer()
+{
+    sphere_storage = { 0, 0, 0, static_cast<int>(sizeof(Sphere)) };
+    node_storage = { 0, 0, 0, static_cast<int>(sizeof(GpuBvhNode)) };
+    light_storage = { 0, 0, 0, static_cast<int>(sizeof(int)) };
+    glGenBuffers(1, &sphere_storage.buffer);
+    glGenBuffers(1, &node_storage.buffer);
+    glGenBuffers(1, &light_storage.buffer);
+
+    reserve(sphere_storage, SCENE_MIN_CAPACITY);
+    reserve(node_storage, 2 * SCENE_MIN_CAPACITY);
+    reserve(light_storage, SCENE_LIGHT_MIN_CAPACITY);
+}
+
+void SceneBuffer::destroy()
+{
+    glDeleteBuffers(1, &sphere_storage.buffer);
+    glDeleteBuffers(1, &node_storage.buffer);
+    glDeleteBuffers(1, &light_storage.buffer);
+}
+
+bool SceneBuffer::reserve(Storage& storage, int count)
+{
+    if (count <= storage.capacity)
+        return false;
+
+    // Doubling keeps the number of reallocations (and shader rebuilds) logarithmic
+    int capacity = std::max(storage.capacity, 1);
+    while (capacity < count)
+        capacity *= 2;
+
+    // The old contents are dropped, upload() rewrites everything after growing
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, storage.buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(capacity) * storage.element_size, nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    storage.capacity = capacity;
+    return true;
+}
+
+void SceneBuffer::write(Storage& storage, int first, int count, const void* data)
+{
+    if (count <= 0)
+        return;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, storage.buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, GLintptr(first) * storage.element_size,
+        GLsizeiptr(count) * storage.element_size, data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+bool SceneBuffer::upload(const std::vector<Sphere>& spheres, const std::vector<GpuBvhNode>& nodes)
+{
+    return upload(spheres.data(), static_cast<int>(spheres.size()), nodes.data(), static_cast<int>(nodes.size()));
+}
+
+bool SceneBuffer::upload(const Sphere* spheres, int sphereCount, const GpuBvhNode* nodes, int nodeCount)
+{
+    lights = findLights(spheres, sphereCount);
+
+    bool grown = reserve(sphere_storage, sphereCount);
+    grown = reserve(node_storage, nodeCount) || grown;
+    grown = reserve(light_storage, static_cast<int>(lights.size())) || grown;
+
+    sphere_storage.count = sphereCount;
+    node_storage.count = nodeCount;
+    light_storage.count = static_cast<int>(lights.size());
+    write(sphere_storage, 0, sphere_storage.count, spheres);
+    write(node_storage, 0, node_storage.count, nodes);
+    write(light_storage, 0, light_storage.count, lights.data());
+    return grown;
+}
+
+bool SceneBuffer::updateSpheres(int first, int count, const Sphere* spheres)
+{
+    if (first < 0 || count < 0 || first + count > sphere_storage.count)
+    {
+        std::cerr << "ERROR::SCENE_BUFFER::UPDATE_OUT_OF_RANGE " << first << "+" << count << std::endl;
+        return false;
+    }
+    write(sphere_storage, first, count, spheres);
+
+    // Swap the range's entries in the light list for the ones that emit now
+    lights.erase(std::remove_if(lights.begin(), lights.end(), [&](int index)
+    {
+        return index >= first && index < first + count;
+    }), lights.end());
+    for (int i = 0; i < count; i++)
+    {
+        if (isEmissive(spheres[i]))
+            lights.push_back(first + i);
+    }
+    std::sort(lights.begin(), lights.end());
+
+    bool grown = reserve(light_storage, static_cast<int>(lights.size()));
+    light_storage.count = static_cast<int>(lights.size());
+    write(light_storage, 0, light_storage.count, lights.data());
+    return grown;
+}
+
+void SceneBuffer::bind(GLuint sphereBinding, GLuint nodeBinding, GLuint lightBinding) const
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sphereBinding, sphere_storage.buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, nodeBinding, node_storage.buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, lightBinding, light_storage.buffer);
+}
+
+std::string SceneBuffer::shaderDefines() const
+{
+    return "#define SPHERE_CAPACITY " + std::to_string(sphere_storage.capacity) + "\n"
+        + "#define NODE_CAPACITY " + std::to_string(node_storage.capacity) + "\n"
+        + "#define LIGHT_CAPACITY " + std::to_string(light_storage.capacity) + "\n";
+}
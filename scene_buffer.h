@@ -0,0 +1,72 @@
+#ifndef SCENE_BUFFER_H
+#define SCENE_BUFFER_H
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "bvh.h"
+
+// Spheres start with room for this many, nodes with twice as many
+#define SCENE_MIN_CAPACITY 64
+// Most scenes only have a few lights
+#define SCENE_LIGHT_MIN_CAPACITY 8
+
+// GPU copy of the spheres, the flattened BVH and the indices of the emissive
+// spheres (for light sampling) in shader storage buffers.
+// Storage grows geometrically, so a growing scene only reallocates now and
+// then. The capacities are compiled into the shader, so the program has to be
+// rebuilt with shaderDefines() whenever upload() reports a new capacity.
+class SceneBuffer
+{
+public:
+    SceneBuffer();
+
+    SceneBuffer(const SceneBuffer&) = delete;
+    SceneBuffer& operator=(const SceneBuffer&) = delete;
+
+    // Function to delete the GL buffers, must run while the context is still alive
+    void destroy();
+
+    // Function to upload the whole scene, returns true if a capacity changed
+    bool upload(const std::vector<Sphere>& spheres, const std::vector<GpuBvhNode>& nodes);
+
+    // Same as above for records stored elsewhere, e.g. straight from a mapped scene file
+    bool upload(const Sphere* spheres, int sphereCount, const GpuBvhNode* nodes, int nodeCount);
+
+    // Function to overwrite spheres in place. The range must lie within the
+    // uploaded spheres, so changing materials does not touch the BVH. The light
+    // list follows emission changes, returns true if its capacity changed.
+    bool updateSpheres(int first, int count, const Sphere* spheres);
+
+    // Function to bind the buffers to their shader storage binding points
+    void bind(GLuint sphereBinding, GLuint nodeBinding, GLuint lightBinding) const;
+
+    // Function to get the #define lines that size the shader's arrays
+    std::string shaderDefines() const;
+
+    int sphereCount() const { return sphere_storage.count; }
+    int sphereCapacity() const { return sphere_storage.capacity; }
+    int nodeCapacity() const { return node_storage.capacity; }
+    int lightCount() const { return light_storage.count; }
+
+private:
+    struct Storage
+    {
+        GLuint buffer;
+        int count;
+        int capacity;
+        int element_size;
+    };
+
+    // Function to make room for count elements, returns true if the buffer was reallocated
+    static bool reserve(Storage& storage, int count);
+    static void write(Storage& storage, int first, int count, const void* data);
+
+    Storage sphere_storage;
+    Storage node_storage;
+    Storage light_storage;
+    std::vector<int> lights; // CPU copy of the light list, so updates can edit it
+};
+
+#endif // SCENE_BUFFER_H
@@ -0,0 +1,376 @@
+#include "scene_file.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+
+static_assert(sizeof(Sphere) == 48, "Sphere records must match the shader layout");
+static_assert(sizeof(BvhNode) == 32 && sizeof(GpuBvhNode) == 32, "BVH records must be 32 bytes");
+
+static uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+// Function to check that a section lies inside the file. The end is never
+// computed, so offsets near the top of the range cannot wrap around.
+static bool sectionFits(uint64_t offset, uint64_t count, uint64_t recordSize, size_t fileSize)
+{
+    return offset % SCENE_FILE_ALIGNMENT == 0 && offset <= fileSize && count <= (fileSize - offset) / recordSize;
+}
+
+// Function to check that the BVH records only point inside the file. Every node
+// but the root must be the child of exactly one earlier node, leaves must cover
+// spheres that exist, and the tree must fit the traversal stack. The shader's
+// miss links have to move forward so its walk ends.
+static bool validBvhRecords(const BvhNode* nodes, const GpuBvhNode* gpuNodes, int nodeCount, int sphereCount)
+{
+    vector<int> depth(nodeCount, 0);
+    depth[0] = 1;
+    for (int i = 0; i < nodeCount; i++)
+    {
+        const BvhNode& node = nodes[i];
+        if (depth[i] == 0 || depth[i] > BVH_STACK_SIZE || node.count < 0 || node.count > BVH_MAX_LEAF_SIZE)
+            return false;
+        if (node.count > 0)
+        {
+            if (node.left_first < 0 || node.left_first > sphereCount - node.count)
+                return false;
+            continue;
+        }
+        if (node.left_first <= i || node.left_first > nodeCount - 2
+            || depth[node.left_first] != 0 || depth[node.left_first + 1] != 0)
+            return false;
+        depth[node.left_first] = depth[i] + 1;
+        depth[node.left_first + 1] = depth[i] + 1;
+    }
+
+    for (int i = 0; i < nodeCount; i++)
+    {
+        const GpuBvhNode& node = gpuNodes[i];
+        if (node.miss_index != -1 && (node.miss_index <= i || node.miss_index >= nodeCount))
+            return false;
+        if (node.sphere_range < 0)
+            return false;
+        int first = node.sphere_range >> GPU_LEAF_COUNT_BITS;
+        int count = node.sphere_range & ((1 << GPU_LEAF_COUNT_BITS) - 1);
+        if (count > BVH_MAX_LEAF_SIZE || (count == 0 && first != 0) || first > sphereCount - count)
+            return false;
+    }
+    return true;
+}
+
+SceneFile::SceneFile()
+    : data(nullptr), size(0)
+#ifdef _WIN32
+    , file_handle(nullptr), mapping_handle(nullptr)
+#endif
+{
+}
+
+SceneFile::~SceneFile()
+{
+    close();
+}
+
+bool SceneFile::open(const string& path)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Failed to open scene file: " << path << std::endl;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    HANDLE mapping = fileSize.QuadPart > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view)
+    {
+        std::cerr << "Failed to map scene file: " << path << std::endl;
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle = file;
+    mapping_handle = mapping;
+    data = static_cast<const unsigned char*>(view);
+    size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open scene file: " << path << std::endl;
+        return false;
+    }
+    struct stat info;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+        view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (view == MAP_FAILED)
+    {
+        std::cerr << "Failed to map scene file: " << path << std::endl;
+        return false;
+    }
+    data = static_cast<const unsigned char*>(view);
+    size = size_t(info.st_size);
+#endif
+
+    // The header and the tree are checked here, the spheres are only floats and
+    // are touched lazily
+    const SceneFileHeader* head = reinterpret_cast<const SceneFileHeader*>(data);
+    bool valid = size >= sizeof(SceneFileHeader) && std::memcmp(head->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) == 0;
+    if (valid && head->version != SCENE_FILE_VERSION)
+    {
+        std::cerr << "Unsupported scene file version " << head->version << ": " << path << std::endl;
+        close();
+        return false;
+    }
+    if (valid)
+    {
+        // Counts are used as ints from here on
+        valid = head->sphere_count <= uint32_t(INT32_MAX) && head->node_count <= uint32_t(INT32_MAX)
+            && sectionFits(head->sphere_offset, head->sphere_count, sizeof(Sphere), size);
+        if (valid && (head->flags & SCENE_FILE_HAS_BVH))
+        {
+            valid = head->node_count > 0
+                && sectionFits(head->node_offset, head->node_count, sizeof(BvhNode), size)
+                && sectionFits(head->gpu_node_offset, head->node_count, sizeof(GpuBvhNode), size)
+                && validBvhRecords(nodes(), gpuNodes(), nodeCount(), sphereCount());
+        }
+    }
+    if (!valid)
+    {
+        std::cerr << "Not a valid scene file: " << path << std::endl;
+        close();
+        return false;
+    }
+
+#ifndef _WIN32
+    // Uploads and the first frames read every record, start paging them in now
+    madvise(const_cast<unsigned char*>(data), size, MADV_WILLNEED);
+#endif
+    return true;
+}
+
+void SceneFile::close()
+{
+    if (!data)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+    file_handle = nullptr;
+    mapping_handle = nullptr;
+#else
+    munmap(const_cast<unsigned char*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+static void writePadding(std::ofstream& file, uint64_t& position, uint64_t target)
+{
+    static const char zeros[SCENE_FILE_ALIGNMENT] = {};
+    file.write(zeros, std::streamsize(target - position));
+    position = target;
+}
+
+bool writeSceneFile(const string& path, const vector<Sphere>& spheres, const Camera& camera, const Bvh* bvh)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Failed to create scene file: " << path << std::endl;
+        return false;
+    }
+
+    vector<GpuBvhNode> gpuNodes;
+    int nodeCount = 0;
+    if (bvh && bvh->nodeCount() > 0)
+    {
+        gpuNodes = bvh->flatten();
+        nodeCount = bvh->nodeCount();
+    }
+
+    SceneFileHeader header = {};
+    std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+    header.version = SCENE_FILE_VERSION;
+    header.flags = nodeCount > 0 ? SCENE_FILE_HAS_BVH : 0;
+    header.sphere_count = static_cast<uint32_t>(spheres.size());
+    header.node_count = static_cast<uint32_t>(nodeCount);
+    header.sphere_offset = alignOffset(sizeof(SceneFileHeader));
+    header.node_offset = alignOffset(header.sphere_offset + spheres.size() * sizeof(Sphere));
+    header.gpu_node_offset = alignOffset(header.node_offset + size_t(nodeCount) * sizeof(BvhNode));
+    header.camera = camera;
+
+    // Every target we build for is little-endian, so the records are written as they are in memory
+    uint64_t position = sizeof(SceneFileHeader);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writePadding(file, position, header.sphere_offset);
+    file.write(reinterpret_cast<const char*>(spheres.data()), std::streamsize(spheres.size() * sizeof(Sphere)));
+    position += spheres.size() * sizeof(Sphere);
+    if (nodeCount > 0)
+    {
+        writePadding(file, position, header.node_offset);
+        file.write(reinterpret_cast<const char*>(bvh->getNodes()), std::streamsize(size_t(nodeCount) * sizeof(BvhNode)));
+        position += size_t(nodeCount) * sizeof(BvhNode);
+        writePadding(file, position, header.gpu_node_offset);
+        file.write(reinterpret_cast<const char*>(gpuNodes.data()), std::streamsize(gpuNodes.size() * sizeof(GpuBvhNode)));
+    }
+
+    if (!file)
+    {
+        std::cerr << "Failed to write scene file: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool loadSceneText(const string& path, vector<Sphere>& spheres, Camera& camera)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+
+    spheres.clear();
+    camera = cameraSetup();
+
+    string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+            line.erase(comment);
+
+        std::istringstream fields(line);
+        string keyword;
+        if (!(fields >> keyword))
+            continue;
+
+        bool valid = false;
+        if (keyword == "camera")
+        {
+            Camera c;
+            valid = bool(fields >> c.camera_center.x >> c.camera_center.y >> c.camera_center.z >> c.focal_length >> c.viewport_height);
+            if (valid)
+                camera = c;
+        }
+        else if (keyword == "sphere")
+        {
+            Sphere s;
+            Material& m = s.material;
+            valid = bool(fields >> s.center.x >> s.center.y >> s.center.z >> s.radius
+                >> m.color.r >> m.color.g >> m.color.b >> m.emission_strength
+                >> m.emmision_color.r >> m.emmision_color.g >> m.emmision_color.b >> m.reflection_strength);
+            if (valid)
+                spheres.push_back(s);
+        }
+
+        string extra;
+        if (!valid || fields >> extra)
+        {
+            std::cerr << path << ":" << lineNumber << ": invalid scene line" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool convertSceneText(const string& inputPath, const string& outputPath)
+{
+    vector<Sphere> spheres;
+    Camera camera;
+    if (!loadSceneText(inputPath, spheres, camera))
+        return false;
+
+    // The tree reorders the spheres, so they are written in leaf order
+    Bvh bvh;
+    bvh.build(spheres.data(), static_cast<int>(spheres.size()));
+    if (!writeSceneFile(outputPath, spheres, camera, &bvh))
+        return false;
+
+    const BvhStats& stats = bvh.getStats();
+    std::cout << "Converted " << spheres.size() << " spheres (" << stats.node_count << " BVH nodes, built in "
+              << stats.build_ms << " ms) to " << outputPath << std::endl;
+    return true;
+}
+
+bool loadScene(const string& path, int extraSpheres, bool needBvh, SceneData& scene)
+{
+    scene.file.close();
+    scene.owned_spheres.clear();
+    scene.owned_gpu_nodes.clear();
+    scene.bvh.attach(nullptr, 0);
+    scene.gpu_nodes = nullptr;
+    scene.gpu_node_count = 0;
+
+    if (!path.empty())
+    {
+        if (!scene.file.open(path))
+            return false;
+        scene.camera = scene.file.header().camera;
+
+        // Use the mapped records directly when nothing has to be added or rebuilt
+        if (extraSpheres <= 0 && (scene.file.hasBvh() || !needBvh))
+        {
+            scene.spheres = scene.file.spheres();
+            scene.sphere_count = scene.file.sphereCount();
+            if (scene.file.hasBvh())
+            {
+                scene.bvh.attach(scene.file.nodes(), scene.file.nodeCount());
+                scene.gpu_nodes = scene.file.gpuNodes();
+                scene.gpu_node_count = scene.file.nodeCount();
+            }
+            return true;
+        }
+
+        scene.owned_spheres.assign(scene.file.spheres(), scene.file.spheres() + scene.file.sphereCount());
+        scene.file.close();
+    }
+    else
+    {
+        scene.owned_spheres = spheresSetup();
+        scene.camera = cameraSetup();
+    }
+
+    addRandomSpheres(scene.owned_spheres, extraSpheres, 1234);
+    if (needBvh)
+    {
+        scene.bvh.build(scene.owned_spheres.data(), static_cast<int>(scene.owned_spheres.size()));
+        scene.owned_gpu_nodes = scene.bvh.flatten();
+    }
+
+    scene.spheres = scene.owned_spheres.data();
+    scene.sphere_count = static_cast<int>(scene.owned_spheres.size());
+    scene.gpu_nodes = scene.owned_gpu_nodes.data();
+    scene.gpu_node_count = static_cast<int>(scene.owned_gpu_nodes.size());
+    return true;
+}
@@ -0,0 +1,105 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "scene.h"
+#include "bvh.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary scene file, little-endian:
+//   SceneFileHeader
+//   sphere_count Sphere records (48 bytes, the same layout the shader reads)
+//   node_count BvhNode records for the CPU tracer       (if SCENE_FILE_HAS_BVH)
+//   node_count GpuBvhNode records for the shader        (if SCENE_FILE_HAS_BVH)
+// Every section starts on a SCENE_FILE_ALIGNMENT boundary, and the spheres are
+// stored in the order the BVH leaves expect.
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_ALIGNMENT 64
+#define SCENE_FILE_HAS_BVH 1
+
+struct SceneFileHeader
+{
+    char magic[8];          // SCENE_FILE_MAGIC with its terminator
+    uint32_t version;
+    uint32_t flags;
+    uint32_t sphere_count;
+    uint32_t node_count;    // entries in each node section, 0 without a BVH
+    uint64_t sphere_offset; // byte offsets from the start of the file
+    uint64_t node_offset;
+    uint64_t gpu_node_offset;
+    Camera camera;
+    uint32_t reserved[3];
+};
+
+// Read-only memory mapping of a scene file. The records are used straight from
+// the mapping, so they stay valid until close() or the destructor.
+class SceneFile
+{
+public:
+    SceneFile();
+    ~SceneFile();
+
+    SceneFile(const SceneFile&) = delete;
+    SceneFile& operator=(const SceneFile&) = delete;
+
+    // Function to map the file and check the header and the BVH records, returns
+    // false on error
+    bool open(const std::string& path);
+
+    // Function to unmap the file
+    void close();
+
+    const SceneFileHeader& header() const { return *reinterpret_cast<const SceneFileHeader*>(data); }
+    const Sphere* spheres() const { return reinterpret_cast<const Sphere*>(data + header().sphere_offset); }
+    int sphereCount() const { return static_cast<int>(header().sphere_count); }
+    bool hasBvh() const { return (header().flags & SCENE_FILE_HAS_BVH) != 0; }
+    const BvhNode* nodes() const { return reinterpret_cast<const BvhNode*>(data + header().node_offset); }
+    const GpuBvhNode* gpuNodes() const { return reinterpret_cast<const GpuBvhNode*>(data + header().gpu_node_offset); }
+    int nodeCount() const { return static_cast<int>(header().node_count); }
+
+private:
+    const unsigned char* data;
+    size_t size;
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#endif
+};
+
+// Function to write a scene file. The spheres must be in the order bvh was built
+// over, bvh may be null to leave the tree out.
+bool writeSceneFile(const std::string& path, const std::vector<Sphere>& spheres, const Camera& camera, const Bvh* bvh);
+
+// Function to read the text scene description. One record per line, # starts a comment:
+//   camera cx cy cz focal_length viewport_height
+//   sphere cx cy cz radius r g b emission_strength er eg eb reflection_strength
+bool loadSceneText(const std::string& path, std::vector<Sphere>& spheres, Camera& camera);
+
+// Function to convert a text description to a scene file with a prebuilt BVH
+bool convertSceneText(const std::string& inputPath, const std::string& outputPath);
+
+// Scene ready to render. Spheres and nodes point into the mapped file when one
+// was loaded and already has a tree, otherwise into the owned vectors.
+struct SceneData
+{
+    const Sphere* spheres = nullptr;
+    int sphere_count = 0;
+    Camera camera;
+    Bvh bvh;
+    const GpuBvhNode* gpu_nodes = nullptr;
+    int gpu_node_count = 0;
+
+    SceneFile file;
+    std::vector<Sphere> owned_spheres;
+    std::vector<GpuBvhNode> owned_gpu_nodes;
+};
+
+// Function to load a scene file, or the built-in scene plus extraSpheres random
+// ones if path is empty. With needBvh the tree (and its GPU layout) is built
+// when the source does not provide one.
+bool loadScene(const std::string& path, int extraSpheres, bool needBvh, SceneData& scene);
+
+#endif // SCENE_FILE_H
@@ -1,7 +1,31 @@
 #include "shader.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Every cached binary starts with this header, followed by length bytes of program
+struct ProgramCacheHeader {
+    char magic[8];  // "RTPROG" and a format version
+    uint64_t key;   // hash of the sources and the driver the binary was made by
+    uint32_t format;
+    uint32_t length;
+};
+
+static const char PROGRAM_CACHE_MAGIC[8] = { 'R', 'T', 'P', 'R', 'O', 'G', '1', '\0' };
 
 // Function to read shader source code from a file
 std::string readShaderSource(const char* filepath) {
@@ -16,12 +40,8 @@ std::string readShaderSource(const char* filepath) {
     return buffer.str();
 }
 
-// Function to compile a shader
-GLuint compileShader(GLenum type, const char* source) {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, nullptr);
-    glCompileShader(shader);
-
+// Function to print a shader's compile errors, the query waits for the compile to finish
+static bool reportShader(GLuint shader) {
     int success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
     if (!success) {
@@ -29,33 +49,535 @@ GLuint compileShader(GLenum type, const char* source) {
         glGetShaderInfoLog(shader, 512, nullptr, infoLog);
         std::cerr << "ERROR::SHADER::COMPILATION_FAILED\n" << infoLog << std::endl;
     }
+    return success != 0;
+}
 
+// Function to print a program's link errors
+static bool reportLink(GLuint program) {
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(program, 512, nullptr, infoLog);
+        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    }
+    return success != 0;
+}
+
+static GLuint startShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
     return shader;
 }
 
-// Function to create a shader program
-GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath) {
-    std::string vertexSource = readShaderSource(vertexFilePath);
-    std::string fragmentSource = readShaderSource(fragmentFilePath);
+// Function to compile a shader
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = startShader(type, source);
+    reportShader(shader);
+    return shader;
+}
+
+// Function to insert #define lines right after the #version line
+std::string injectDefines(const std::string& source, const std::string& defines) {
+    if (defines.empty()) {
+        return source;
+    }
+
+    // #version has to stay first, everything else may follow the defines
+    size_t lineEnd = 0;
+    if (source.compare(0, 8, "#version") == 0) {
+        lineEnd = source.find('\n');
+        lineEnd = lineEnd == std::string::npos ? source.size() : lineEnd + 1;
+    }
+    std::string result = source.substr(0, lineEnd);
+    if (!result.empty() && result.back() != '\n') {
+        result += '\n';
+    }
+    return result + defines + source.substr(lineEnd);
+}
+
+std::string defineLines(const ShaderDefines& defines) {
+    std::string lines;
+    for (const auto& define : defines) {
+        lines += "#define " + define.first + " " + std::to_string(define.second) + "\n";
+    }
+    return lines;
+}
 
-    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource.c_str());
-    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource.c_str());
+// Function to issue the compile and link without asking for any results. With
+// parallel shader compile the driver works on it in the background until a
+// status is queried.
+static GLuint startProgram(const std::string& vertexSource, const std::string& fragmentSource, GLuint& vertexShader, GLuint& fragmentShader) {
+    vertexShader = startShader(GL_VERTEX_SHADER, vertexSource.c_str());
+    fragmentShader = startShader(GL_FRAGMENT_SHADER, fragmentSource.c_str());
 
     GLuint shaderProgram = glCreateProgram();
     glAttachShader(shaderProgram, vertexShader);
     glAttachShader(shaderProgram, fragmentShader);
+    glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(shaderProgram);
+    return shaderProgram;
+}
 
-    int success;
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
-        std::cerr << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
+// Function to compile and link a program from source
+GLuint linkProgram(const std::string& vertexSource, const std::string& fragmentSource) {
+    GLuint vertexShader, fragmentShader;
+    GLuint shaderProgram = startProgram(vertexSource, fragmentSource, vertexShader, fragmentShader);
+
+    reportShader(vertexShader);
+    reportShader(fragmentShader);
+    reportLink(shaderProgram);
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
 
     return shaderProgram;
 }
+
+// Function to create a shader program
+GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines) {
+    std::string vertexSource = injectDefines(readShaderSource(vertexFilePath), defines);
+    std::string fragmentSource = injectDefines(readShaderSource(fragmentFilePath), defines);
+    return linkProgram(vertexSource, fragmentSource);
+}
+
+GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath, const ShaderDefines& defines) {
+    return createShaderProgram(vertexFilePath, fragmentFilePath, defineLines(defines));
+}
+
+// 64-bit FNV-1a, chained through seed
+static uint64_t hashString(const std::string& text, uint64_t seed = 14695981039346656037ull) {
+    uint64_t hash = seed;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string glString(GLenum name) {
+    const GLubyte* value = glGetString(name);
+    return value ? reinterpret_cast<const char*>(value) : "";
+}
+
+static bool isLinked(GLuint program) {
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    return success != 0;
+}
+
+// Function to create a program from a cached binary, 0 if there is no usable one
+static GLuint loadProgramBinary(const std::string& path, uint64_t key) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::streamoff fileSize = file ? std::streamoff(file.tellg()) : 0;
+    file.seekg(0);
+    ProgramCacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || std::memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.key != key) {
+        return 0;
+    }
+
+    // The binary fills the rest of the file. A length that says otherwise comes
+    // from a truncated or corrupt file and is not allocated.
+    if (header.length == 0 || header.length > uint32_t(INT32_MAX)
+        || std::streamoff(header.length) != fileSize - std::streamoff(sizeof(header))) {
+        return 0;
+    }
+    std::vector<char> binary(header.length);
+    if (!file.read(binary.data(), binary.size())) {
+        return 0;
+    }
+
+    // Drivers may still refuse their own binaries after an update, that only costs
+    // a compile. A refused binary leaves the program unlinked, so the link status
+    // alone decides, errors left over from earlier calls do not matter.
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), GLsizei(binary.size()));
+    if (!isLinked(program)) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Function to create the cache directory, it is fine if it already exists
+static void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+// Function to write a linked program to the cache, failures only cost a compile next time
+static void saveProgramBinary(const std::string& path, uint64_t key, GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    ProgramCacheHeader header;
+    std::memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+    header.key = key;
+    std::vector<char> binary(length);
+    GLsizei written = 0;
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &written, &format, binary.data());
+    header.format = format;
+    header.length = uint32_t(written);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(binary.data(), written);
+    if (!file) {
+        std::cerr << "WARNING::SHADER::CACHE_WRITE_FAILED " << path << std::endl;
+    }
+}
+
+// Function to check for GL_KHR_parallel_shader_compile or its ARB twin
+static bool hasParallelCompile() {
+    return GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+}
+
+std::string ShaderProgram::cacheLocation(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines,
+    const std::string& vertexSource, const std::string& fragmentSource, uint64_t& key) const {
+    if (cache_dir.empty()) {
+        return "";
+    }
+
+    // Binaries only work on the driver that wrote them, so it is part of the key.
+    // The file name only depends on the program, so edits overwrite the old binary.
+    std::string driver = glString(GL_VENDOR) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+    key = hashString(driver, hashString(fragmentSource, hashString(vertexSource)));
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin",
+        static_cast<unsigned long long>(hashString(std::string(vertexFilePath) + "\n" + fragmentFilePath + "\n" + defines)));
+    return cache_dir + "/" + name;
+}
+
+bool ShaderProgram::load(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines) {
+    cancelReload();
+    std::string vertexSource = injectDefines(readShaderSource(vertexFilePath), defines);
+    std::string fragmentSource = injectDefines(readShaderSource(fragmentFilePath), defines);
+
+    uint64_t key = 0;
+    std::string cachePath = cacheLocation(vertexFilePath, fragmentFilePath, defines, vertexSource, fragmentSource, key);
+
+    GLuint linked = cachePath.empty() ? 0 : loadProgramBinary(cachePath, key);
+    bool cached = linked != 0;
+    if (!cached) {
+        linked = linkProgram(vertexSource, fragmentSource);
+        if (!isLinked(linked)) {
+            glDeleteProgram(linked);
+            return false;
+        }
+        if (!cachePath.empty()) {
+            makeDirectory(cache_dir);
+            saveProgramBinary(cachePath, key, linked);
+        }
+    }
+
+    adopt(linked, cached);
+    return true;
+}
+
+void ShaderProgram::beginReload(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines) {
+    cancelReload();
+    std::string vertexSource = injectDefines(readShaderSource(vertexFilePath), defines);
+    std::string fragmentSource = injectDefines(readShaderSource(fragmentFilePath), defines);
+
+    // Reverting an edit finds the earlier binary again
+    pending.cache_path = cacheLocation(vertexFilePath, fragmentFilePath, defines, vertexSource, fragmentSource, pending.key);
+    pending.program = pending.cache_path.empty() ? 0 : loadProgramBinary(pending.cache_path, pending.key);
+    pending.from_cache = pending.program != 0;
+    if (pending.from_cache) {
+        return;
+    }
+
+    if (hasParallelCompile()) {
+        if (GLEW_KHR_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+        } else {
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+        }
+    }
+    pending.program = startProgram(vertexSource, fragmentSource, pending.vertex_shader, pending.fragment_shader);
+}
+
+bool ShaderProgram::finishReload() {
+    if (pending.program == 0) {
+        return false;
+    }
+
+    // Still compiling, ask again next frame. Without the extension the status
+    // queries below simply wait for the driver.
+    if (hasParallelCompile()) {
+        GLint done = GL_FALSE;
+        glGetProgramiv(pending.program, GL_COMPLETION_STATUS_KHR, &done);
+        if (!done) {
+            return false;
+        }
+    }
+
+    bool linked = pending.from_cache;
+    if (!linked) {
+        bool vertexOk = reportShader(pending.vertex_shader);
+        bool fragmentOk = reportShader(pending.fragment_shader);
+        linked = reportLink(pending.program) && vertexOk && fragmentOk;
+        if (linked && !pending.cache_path.empty()) {
+            makeDirectory(cache_dir);
+            saveProgramBinary(pending.cache_path, pending.key, pending.program);
+        }
+    }
+
+    if (!linked) {
+        std::cerr << "Shader reload failed, keeping the previous program" << std::endl;
+        cancelReload();
+        return false;
+    }
+
+    GLuint replacement = pending.program;
+    bool cached = pending.from_cache;
+    pending.program = 0;
+    cancelReload();
+    adopt(replacement, cached);
+    return true;
+}
+
+void ShaderProgram::cancelReload() {
+    glDeleteShader(pending.vertex_shader);
+    glDeleteShader(pending.fragment_shader);
+    glDeleteProgram(pending.program);
+    pending = PendingBuild();
+}
+
+void ShaderProgram::adopt(GLuint linked, bool cached) {
+    glDeleteProgram(program);
+    program = linked;
+    from_cache = cached;
+    reflect();
+}
+
+void ShaderProgram::destroy() {
+    cancelReload();
+    glDeleteProgram(program);
+    program = 0;
+    uniforms.clear();
+    blocks.clear();
+}
+
+void ShaderProgram::reflect() {
+    uniforms.clear();
+    blocks.clear();
+
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<char> name(std::max(maxLength, 1));
+
+    for (GLint i = 0; i < count; i++) {
+        GLsizei length = 0;
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program, GLuint(i), GLsizei(name.size()), &length, &size, &type, name.data());
+
+        // Members of uniform blocks have no location of their own
+        GLint location = glGetUniformLocation(program, name.data());
+        if (location < 0) {
+            continue;
+        }
+
+        std::string key(name.data(), length);
+        if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) {
+            key.resize(key.size() - 3);
+        }
+        uniforms[key] = location;
+    }
+
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+    name.assign(std::max(maxLength, 1), '\0');
+
+    for (GLint i = 0; i < count; i++) {
+        GLsizei length = 0;
+        glGetActiveUniformBlockName(program, GLuint(i), GLsizei(name.size()), &length, name.data());
+        blocks[std::string(name.data(), length)] = GLuint(i);
+    }
+}
+
+GLint ShaderProgram::uniformLocation(const std::string& name) const {
+    auto it = uniforms.find(name);
+    return it == uniforms.end() ? -1 : it->second;
+}
+
+bool ShaderProgram::bindUniformBlock(const std::string& name, GLuint binding) const {
+    auto it = blocks.find(name);
+    if (it == blocks.end()) {
+        return false;
+    }
+    glUniformBlockBinding(program, it->second, binding);
+    return true;
+}
+
+ShaderPermutations::ShaderPermutations(const std::string& vertexFilePath, const std::string& fragmentFilePath, const std::string& common)
+    : vertex_path(vertexFilePath), fragment_path(fragmentFilePath), common(common) {
+}
+
+ShaderProgram* ShaderPermutations::get(const ShaderDefines& defines) {
+    std::string lines = defineLines(defines);
+    bool known = programs.count(lines) != 0;
+    ShaderProgram& program = programs[lines];
+
+    // A permutation that failed stays empty until the next reload
+    if (!known && program.load(vertex_path.c_str(), fragment_path.c_str(), common + lines)) {
+        bindBlocks(program);
+    }
+    return program.id() != 0 ? &program : nullptr;
+}
+
+void ShaderPermutations::bindUniformBlock(const std::string& name, GLuint binding) {
+    block_bindings[name] = binding;
+    for (const auto& entry : programs) {
+        entry.second.bindUniformBlock(name, binding);
+    }
+}
+
+void ShaderPermutations::bindBlocks(const ShaderProgram& program) const {
+    for (const auto& block : block_bindings) {
+        program.bindUniformBlock(block.first, block.second);
+    }
+}
+
+void ShaderPermutations::beginReload() {
+    for (auto& entry : programs) {
+        entry.second.beginReload(vertex_path.c_str(), fragment_path.c_str(), common + entry.first);
+    }
+}
+
+bool ShaderPermutations::finishReload() {
+    bool swapped = false;
+    for (auto& entry : programs) {
+        if (entry.second.finishReload()) {
+            bindBlocks(entry.second);
+            swapped = true;
+        }
+    }
+    return swapped;
+}
+
+bool ShaderPermutations::reloadPending() const {
+    for (const auto& entry : programs) {
+        if (entry.second.reloadPending()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ShaderPermutations::destroy() {
+    for (auto& entry : programs) {
+        entry.second.destroy();
+    }
+    programs.clear();
+}
+
+#ifdef __linux__
+ShaderWatcher::ShaderWatcher(const std::vector<std::string>& paths) : paths(paths) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        std::cerr << "WARNING::SHADER::WATCH_FAILED inotify unavailable" << std::endl;
+    }
+
+    for (const std::string& path : paths) {
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+        names.push_back(slash == std::string::npos ? path : path.substr(slash + 1));
+
+        // Saving by rename replaces the file, so the directory is what gets watched.
+        // inotify hands out the same descriptor when two files share a directory.
+        int watch = inotify_fd < 0 ? -1 : inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (inotify_fd >= 0 && watch < 0) {
+            std::cerr << "WARNING::SHADER::WATCH_FAILED " << directory << std::endl;
+        }
+        watches.push_back(watch);
+    }
+}
+
+ShaderWatcher::~ShaderWatcher() {
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+bool ShaderWatcher::poll() {
+    if (inotify_fd < 0) {
+        return false;
+    }
+
+    // Drain every queued event, one save usually produces several
+    bool changed = false;
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char* at = buffer; at < buffer + length; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(at);
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (event->wd == watches[i] && event->len > 0 && names[i] == event->name) {
+                    changed = true;
+                }
+            }
+            at += sizeof(inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+#else
+static long long modificationTime(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? static_cast<long long>(info.st_mtime) : -1;
+}
+
+ShaderWatcher::ShaderWatcher(const std::vector<std::string>& paths) : paths(paths) {
+    for (const std::string& path : paths) {
+        modified.push_back(modificationTime(path));
+    }
+}
+
+ShaderWatcher::~ShaderWatcher() {
+}
+
+bool ShaderWatcher::poll() {
+    bool changed = false;
+    for (size_t i = 0; i < paths.size(); i++) {
+        long long time = modificationTime(paths[i]);
+        if (time != modified[i]) {
+            modified[i] = time;
+            changed = true;
+        }
+    }
+    return changed;
+}
+#endif
+
+UniformBuffer::UniformBuffer(size_t size) : size(size) {
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, GLsizeiptr(size), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UniformBuffer::destroy() {
+    glDeleteBuffers(1, &buffer);
+}
+
+void UniformBuffer::update(const void* data) {
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, GLsizeiptr(size), data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void UniformBuffer::bind(GLuint binding) const {
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+}
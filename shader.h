@@ -2,7 +2,15 @@
 #define SHADER_H
 
 #include <GL/glew.h>
+#include <cstdint>
+#include <map>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+// Linked programs are cached here, relative to the working directory like the
+// shader files themselves
+#define SHADER_CACHE_DIR "shader_cache"
 
 // Function to read shader source code from a file
 std::string readShaderSource(const char* filepath);
@@ -10,7 +18,190 @@ std::string readShaderSource(const char* filepath);
 // Function to compile a shader
 GLuint compileShader(GLenum type, const char* source);
 
-// Function to create a shader program
-GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath);
+// Function to insert #define lines right after the #version line
+std::string injectDefines(const std::string& source, const std::string& defines);
+
+// Function to compile and link a program from source. The driver is asked to
+// keep the binary retrievable for the program cache.
+GLuint linkProgram(const std::string& vertexSource, const std::string& fragmentSource);
+
+// Compile-time settings of one build of the shaders, e.g. MAX_BOUNCE -> 2. The
+// map keeps the names sorted, so equal sets always give the same source text.
+typedef std::map<std::string, int> ShaderDefines;
+
+// Function to turn a set of defines into #define lines
+std::string defineLines(const ShaderDefines& defines);
+
+// Function to create a shader program, defines are injected into both stages
+GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines = "");
+GLuint createShaderProgram(const char* vertexFilePath, const char* fragmentFilePath, const ShaderDefines& defines);
+
+// Linked program together with the locations of its active uniforms and uniform
+// blocks. They are looked up once after linking, so drawing a frame needs no
+// glGetUniformLocation round trips.
+class ShaderProgram {
+public:
+    ShaderProgram() = default;
+
+    ShaderProgram(const ShaderProgram&) = delete;
+    ShaderProgram& operator=(const ShaderProgram&) = delete;
+
+    // Function to build the program from two files. A binary saved by an earlier
+    // run is used when the sources, defines and driver are unchanged, otherwise
+    // the program is compiled and the binary saved. If it does not link, the
+    // previous program stays in use and false is returned.
+    bool load(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines = "");
+
+    // Function to choose where binaries are kept, an empty path turns the cache off
+    void setCacheDirectory(const std::string& directory) { cache_dir = directory; }
+
+    // True if the current program skipped compiling
+    bool loadedFromCache() const { return from_cache; }
+
+    // Function to start building a new version of the program, e.g. after the
+    // files were edited. It returns right away, the current program keeps
+    // drawing until finishReload() swaps in the new one.
+    void beginReload(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines = "");
+
+    // Function to check on a reload without waiting for the driver, when it
+    // supports parallel shader compile. Returns true once the new program is in
+    // use. Compile errors are printed and the old program stays.
+    bool finishReload();
+
+    bool reloadPending() const { return pending.program != 0; }
+
+    // Function to delete the program, must run while the context is still alive
+    void destroy();
+
+    void use() const { glUseProgram(program); }
+    GLuint id() const { return program; }
+
+    // Function to get the cached location of a uniform, -1 if the program does not
+    // use it (glUniform* ignores -1). Arrays are found by their plain name.
+    GLint uniformLocation(const std::string& name) const;
+
+    // Function to connect a uniform block to a binding point, false if the program
+    // does not use the block
+    bool bindUniformBlock(const std::string& name, GLuint binding) const;
+
+private:
+    // A program the driver may still be compiling
+    struct PendingBuild {
+        GLuint program = 0;
+        GLuint vertex_shader = 0;
+        GLuint fragment_shader = 0;
+        bool from_cache = false;
+        std::string cache_path;
+        uint64_t key = 0;
+    };
+
+    // Function to get the cache file for the program, empty if the cache is off
+    std::string cacheLocation(const char* vertexFilePath, const char* fragmentFilePath, const std::string& defines,
+        const std::string& vertexSource, const std::string& fragmentSource, uint64_t& key) const;
+
+    void cancelReload();
+
+    // Function to replace the current program with a linked one
+    void adopt(GLuint linked, bool cached);
+
+    // Function to fill the location tables from the linked program
+    void reflect();
+
+    GLuint program = 0;
+    PendingBuild pending;
+    std::string cache_dir = SHADER_CACHE_DIR;
+    bool from_cache = false;
+    std::unordered_map<std::string, GLint> uniforms;
+    std::unordered_map<std::string, GLuint> blocks;
+};
+
+// Specialized builds of one pair of shader files. Each permutation gets its
+// settings as literal defines, so the shader compiler can unroll its loops and
+// drop disabled features, and the app switches between them without
+// recompiling. Built programs are kept, and saved to the program cache.
+class ShaderPermutations {
+public:
+    // common is injected into every permutation, ahead of its own defines
+    ShaderPermutations(const std::string& vertexFilePath, const std::string& fragmentFilePath, const std::string& common);
+
+    ShaderPermutations(const ShaderPermutations&) = delete;
+    ShaderPermutations& operator=(const ShaderPermutations&) = delete;
+
+    // Function to get the permutation built with these defines, building it on
+    // first use. nullptr if it does not compile, which is only tried once.
+    ShaderProgram* get(const ShaderDefines& defines);
+
+    // Function to connect a uniform block to a binding point in every
+    // permutation, including the ones built or reloaded later
+    void bindUniformBlock(const std::string& name, GLuint binding);
+
+    // Function to start rebuilding every permutation after the files changed
+    void beginReload();
+
+    // Function to swap in the permutations that finished, true if any did
+    bool finishReload();
+
+    // True while any permutation is still being rebuilt
+    bool reloadPending() const;
+
+    // Function to delete the programs, must run while the context is still alive
+    void destroy();
+
+private:
+    void bindBlocks(const ShaderProgram& program) const;
+
+    std::string vertex_path;
+    std::string fragment_path;
+    std::string common;
+    std::map<std::string, ShaderProgram> programs; // keyed by the injected define lines
+    std::map<std::string, GLuint> block_bindings;
+};
+
+// Watches files for changes. Linux uses inotify on the directories, so editors
+// that save by renaming a temporary file are seen too. Elsewhere the
+// modification times are compared on every poll.
+class ShaderWatcher {
+public:
+    explicit ShaderWatcher(const std::vector<std::string>& paths);
+    ~ShaderWatcher();
+
+    ShaderWatcher(const ShaderWatcher&) = delete;
+    ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+    // Function to check whether any file changed since the last call, never blocks
+    bool poll();
+
+private:
+    std::vector<std::string> paths;
+#ifdef __linux__
+    int inotify_fd;
+    std::vector<int> watches;     // watch descriptor of each path's directory
+    std::vector<std::string> names; // file name of each path without the directory
+#else
+    std::vector<long long> modified;
+#endif
+};
+
+// Uniform buffer holding one struct, rewritten in place whenever it changes
+class UniformBuffer {
+public:
+    explicit UniformBuffer(size_t size);
+
+    UniformBuffer(const UniformBuffer&) = delete;
+    UniformBuffer& operator=(const UniformBuffer&) = delete;
+
+    // Function to delete the buffer, must run while the context is still alive
+    void destroy();
+
+    // Function to replace the contents, data must hold the size given at construction
+    void update(const void* data);
+
+    // Function to bind the buffer to a uniform block binding point
+    void bind(GLuint binding) const;
+
+private:
+    GLuint buffer;
+    size_t size;
+};
 
 #endif // SHADER_H
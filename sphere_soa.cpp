@@ -0,0 +1,457 @@
+#include "sphere_soa.h"
+#include <cstring>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Each kernel is compiled for its own instruction set and only called once the
+// CPU is known to support it, so the rest of the program needs no special flags.
+// MSVC accepts the intrinsics without per-function targets.
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+// Keep mul + add separate like the scalar intersectSphere, so every level finds
+// bit-identical distances
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// Largest vector width, the arrays are padded by this much
+#define SOA_PADDING 16
+
+typedef int (*ClosestHitKernel)(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float& dst);
+typedef bool (*AnyHitKernel)(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float maxDst);
+
+static int closestHitScalar(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float& dst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    int closest = -1;
+    for (int i = first; i < first + count; i++)
+    {
+        float ocx = ray.origin.x - cx[i];
+        float ocy = ray.origin.y - cy[i];
+        float ocz = ray.origin.z - cz[i];
+        float b = 2.0f * (ocx * ray.dir.x + ocy * ray.dir.y + ocz * ray.dir.z);
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - r2[i];
+        float discriminant = b * b - 4 * a * c;
+        if (discriminant > 0)
+        {
+            float t = (-b - std::sqrt(discriminant)) / (2.0f * a);
+            if (t < NO_HIT && t > 0.0001f && t < dst)
+            {
+                dst = t;
+                closest = i;
+            }
+        }
+    }
+    return closest;
+}
+
+static bool anyHitScalar(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float maxDst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    for (int i = first; i < first + count; i++)
+    {
+        float ocx = ray.origin.x - cx[i];
+        float ocy = ray.origin.y - cy[i];
+        float ocz = ray.origin.z - cz[i];
+        float b = 2.0f * (ocx * ray.dir.x + ocy * ray.dir.y + ocz * ray.dir.z);
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - r2[i];
+        float discriminant = b * b - 4 * a * c;
+        if (discriminant > 0)
+        {
+            float t = (-b - std::sqrt(discriminant)) / (2.0f * a);
+            if (t < NO_HIT && t > 0.0001f && t < maxDst)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Function to pick the closest lane, ties go to the lower sphere index like the scalar loop
+static int reduceLanes(const float* laneDst, const int* laneIndex, int lanes, float& dst)
+{
+    int closest = -1;
+    for (int i = 0; i < lanes; i++)
+    {
+        if (laneIndex[i] >= 0 && (laneDst[i] < dst || (laneDst[i] == dst && laneIndex[i] < closest)))
+        {
+            dst = laneDst[i];
+            closest = laneIndex[i];
+        }
+    }
+    return closest;
+}
+
+SIMD_TARGET("sse4.2")
+static int closestHitSSE42(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float& dst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    __m128 fourA = _mm_set1_ps(4 * a), twoA = _mm_set1_ps(2.0f * a), two = _mm_set1_ps(2.0f);
+    __m128 zero = _mm_setzero_ps(), minDst = _mm_set1_ps(0.0001f), noHit = _mm_set1_ps(NO_HIT);
+
+    __m128 best = _mm_set1_ps(dst);
+    __m128i bestIndex = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32(first, first + 1, first + 2, first + 3);
+    __m128i end = _mm_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 4)
+    {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(cx + i));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(cy + i));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(cz + i));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(r2 + i));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(fourA, c));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(discriminant)), twoA);
+
+        __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, zero), _mm_cmplt_ps(t, noHit));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, minDst), _mm_cmplt_ps(t, best)));
+        hit = _mm_and_ps(hit, _mm_castsi128_ps(_mm_cmplt_epi32(index, end)));
+
+        best = _mm_blendv_ps(best, t, hit);
+        bestIndex = _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(bestIndex), _mm_castsi128_ps(index), hit));
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+
+    float laneDst[4];
+    int laneIndex[4];
+    _mm_storeu_ps(laneDst, best);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(laneIndex), bestIndex);
+    return reduceLanes(laneDst, laneIndex, 4, dst);
+}
+
+SIMD_TARGET("sse4.2")
+static bool anyHitSSE42(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float maxDst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+    __m128 fourA = _mm_set1_ps(4 * a), twoA = _mm_set1_ps(2.0f * a), two = _mm_set1_ps(2.0f);
+    __m128 zero = _mm_setzero_ps(), minDst = _mm_set1_ps(0.0001f), noHit = _mm_set1_ps(NO_HIT), limit = _mm_set1_ps(maxDst);
+    __m128i index = _mm_setr_epi32(first, first + 1, first + 2, first + 3);
+    __m128i end = _mm_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 4)
+    {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(cx + i));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(cy + i));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(cz + i));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(r2 + i));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(fourA, c));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(discriminant)), twoA);
+
+        __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, zero), _mm_cmplt_ps(t, noHit));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, minDst), _mm_cmplt_ps(t, limit)));
+        hit = _mm_and_ps(hit, _mm_castsi128_ps(_mm_cmplt_epi32(index, end)));
+        if (_mm_movemask_ps(hit) != 0)
+            return true;
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    return false;
+}
+
+SIMD_TARGET("avx2")
+static int closestHitAVX2(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float& dst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+    __m256 fourA = _mm256_set1_ps(4 * a), twoA = _mm256_set1_ps(2.0f * a), two = _mm256_set1_ps(2.0f);
+    __m256 zero = _mm256_setzero_ps(), minDst = _mm256_set1_ps(0.0001f), noHit = _mm256_set1_ps(NO_HIT);
+
+    __m256 best = _mm256_set1_ps(dst);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i end = _mm256_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(cx + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(cy + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(cz + i));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(r2 + i));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(fourA, c));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(discriminant)), twoA);
+
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, noHit, _CMP_LT_OQ));
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, minDst, _CMP_GT_OQ), _mm256_cmp_ps(t, best, _CMP_LT_OQ)));
+        hit = _mm256_and_ps(hit, _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+
+        best = _mm256_blendv_ps(best, t, hit);
+        bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), hit));
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+
+    float laneDst[8];
+    int laneIndex[8];
+    _mm256_storeu_ps(laneDst, best);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(laneIndex), bestIndex);
+    return reduceLanes(laneDst, laneIndex, 8, dst);
+}
+
+SIMD_TARGET("avx2")
+static bool anyHitAVX2(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float maxDst)
+{
+    float a = glm::dot(ray.dir, ray.dir);
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+    __m256 fourA = _mm256_set1_ps(4 * a), twoA = _mm256_set1_ps(2.0f * a), two = _mm256_set1_ps(2.0f);
+    __m256 zero = _mm256_setzero_ps(), minDst = _mm256_set1_ps(0.0001f), noHit = _mm256_set1_ps(NO_HIT), limit = _mm256_set1_ps(maxDst);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i end = _mm256_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 8)
+    {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(cx + i));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(cy + i));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(cz + i));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(r2 + i));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(fourA, c));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(discriminant)), twoA);
+
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, noHit, _CMP_LT_OQ));
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, minDst, _CMP_GT_OQ), _mm256_cmp_ps(t, limit, _CMP_LT_OQ)));
+        hit = _mm256_and_ps(hit, _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, index)));
+        if (_mm256_movemask_ps(hit) != 0)
+            return true;
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    return false;
+}
+
+SIMD_TARGET("avx512f")
+static int closestHitAVX512(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float& dst)
+{
+    // BVH leaves hold at most 8 spheres, a half empty 16-wide vector is slower there
+    if (count <= 8)
+        return closestHitAVX2(cx, cy, cz, r2, ray, first, count, dst);
+
+    float a = glm::dot(ray.dir, ray.dir);
+    __m512 ox = _mm512_set1_ps(ray.origin.x), oy = _mm512_set1_ps(ray.origin.y), oz = _mm512_set1_ps(ray.origin.z);
+    __m512 dx = _mm512_set1_ps(ray.dir.x), dy = _mm512_set1_ps(ray.dir.y), dz = _mm512_set1_ps(ray.dir.z);
+    __m512 fourA = _mm512_set1_ps(4 * a), twoA = _mm512_set1_ps(2.0f * a), two = _mm512_set1_ps(2.0f);
+    __m512 zero = _mm512_setzero_ps(), minDst = _mm512_set1_ps(0.0001f), noHit = _mm512_set1_ps(NO_HIT);
+
+    __m512 best = _mm512_set1_ps(dst);
+    __m512i bestIndex = _mm512_set1_epi32(-1);
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32(first), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    __m512i end = _mm512_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 16)
+    {
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(cx + i));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(cy + i));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(cz + i));
+        __m512 b = _mm512_mul_ps(two, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz)));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)), _mm512_loadu_ps(r2 + i));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(fourA, c));
+        __m512 t = _mm512_div_ps(_mm512_sub_ps(_mm512_sub_ps(zero, b), _mm512_sqrt_ps(discriminant)), twoA);
+
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, noHit, _CMP_LT_OQ)
+            & _mm512_cmp_ps_mask(t, minDst, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, best, _CMP_LT_OQ)
+            & _mm512_cmplt_epi32_mask(index, end);
+
+        best = _mm512_mask_blend_ps(hit, best, t);
+        bestIndex = _mm512_mask_blend_epi32(hit, bestIndex, index);
+        index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+    }
+
+    float laneDst[16];
+    int laneIndex[16];
+    _mm512_storeu_ps(laneDst, best);
+    _mm512_storeu_si512(laneIndex, bestIndex);
+    return reduceLanes(laneDst, laneIndex, 16, dst);
+}
+
+SIMD_TARGET("avx512f")
+static bool anyHitAVX512(const float* cx, const float* cy, const float* cz, const float* r2,
+    const Ray& ray, int first, int count, float maxDst)
+{
+    if (count <= 8)
+        return anyHitAVX2(cx, cy, cz, r2, ray, first, count, maxDst);
+
+    float a = glm::dot(ray.dir, ray.dir);
+    __m512 ox = _mm512_set1_ps(ray.origin.x), oy = _mm512_set1_ps(ray.origin.y), oz = _mm512_set1_ps(ray.origin.z);
+    __m512 dx = _mm512_set1_ps(ray.dir.x), dy = _mm512_set1_ps(ray.dir.y), dz = _mm512_set1_ps(ray.dir.z);
+    __m512 fourA = _mm512_set1_ps(4 * a), twoA = _mm512_set1_ps(2.0f * a), two = _mm512_set1_ps(2.0f);
+    __m512 zero = _mm512_setzero_ps(), minDst = _mm512_set1_ps(0.0001f), noHit = _mm512_set1_ps(NO_HIT), limit = _mm512_set1_ps(maxDst);
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32(first), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    __m512i end = _mm512_set1_epi32(first + count);
+
+    for (int i = first; i < first + count; i += 16)
+    {
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(cx + i));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(cy + i));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(cz + i));
+        __m512 b = _mm512_mul_ps(two, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz)));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)), _mm512_loadu_ps(r2 + i));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(fourA, c));
+        __m512 t = _mm512_div_ps(_mm512_sub_ps(_mm512_sub_ps(zero, b), _mm512_sqrt_ps(discriminant)), twoA);
+
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, noHit, _CMP_LT_OQ)
+            & _mm512_cmp_ps_mask(t, minDst, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, limit, _CMP_LT_OQ)
+            & _mm512_cmplt_epi32_mask(index, end);
+        if (hit != 0)
+            return true;
+        index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+    }
+    return false;
+}
+
+#ifdef _MSC_VER
+static bool osSavesAvxState(unsigned long long mask)
+{
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    return osxsave && (_xgetbv(0) & mask) == mask;
+}
+#endif
+
+SimdLevel detectSimdLevel()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return SimdLevel::SSE42;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse42 = (info[2] & (1 << 20)) != 0;
+    bool avx2 = false, avx512 = false;
+    if (maxLeaf >= 7)
+    {
+        __cpuidex(info, 7, 0);
+        // The OS has to save the YMM (and for AVX-512 the ZMM and mask) registers
+        avx2 = (info[1] & (1 << 5)) != 0 && osSavesAvxState(0x6);
+        avx512 = (info[1] & (1 << 16)) != 0 && osSavesAvxState(0xE6);
+    }
+    if (avx512)
+        return SimdLevel::AVX512;
+    if (avx2)
+        return SimdLevel::AVX2;
+    if (sse42)
+        return SimdLevel::SSE42;
+#endif
+    return SimdLevel::Scalar;
+}
+
+static ClosestHitKernel kernelFor(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX512: return closestHitAVX512;
+    case SimdLevel::AVX2: return closestHitAVX2;
+    case SimdLevel::SSE42: return closestHitSSE42;
+    default: return closestHitScalar;
+    }
+}
+
+static AnyHitKernel anyKernelFor(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX512: return anyHitAVX512;
+    case SimdLevel::AVX2: return anyHitAVX2;
+    case SimdLevel::SSE42: return anyHitSSE42;
+    default: return anyHitScalar;
+    }
+}
+
+static SimdLevel currentLevel = detectSimdLevel();
+static ClosestHitKernel currentKernel = kernelFor(currentLevel);
+static AnyHitKernel currentAnyKernel = anyKernelFor(currentLevel);
+
+SimdLevel setSimdLevel(SimdLevel level)
+{
+    SimdLevel supported = detectSimdLevel();
+    currentLevel = level > supported ? supported : level;
+    currentKernel = kernelFor(currentLevel);
+    currentAnyKernel = anyKernelFor(currentLevel);
+    return currentLevel;
+}
+
+SimdLevel getSimdLevel()
+{
+    return currentLevel;
+}
+
+const char* simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX512: return "avx512";
+    case SimdLevel::AVX2: return "avx2";
+    case SimdLevel::SSE42: return "sse4.2";
+    default: return "scalar";
+    }
+}
+
+bool parseSimdLevel(const char* name, SimdLevel& level)
+{
+    for (SimdLevel candidate : { SimdLevel::Scalar, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (std::strcmp(name, simdLevelName(candidate)) == 0)
+        {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SphereSoA::build(const Sphere* spheres, int numSpheres)
+{
+    sphere_count = numSpheres;
+
+    // Padding spheres have a negative squared radius, so they can never be hit
+    size_t padded = size_t(numSpheres) + SOA_PADDING;
+    center_x.assign(padded, 0.0f);
+    center_y.assign(padded, 0.0f);
+    center_z.assign(padded, 0.0f);
+    radius2.assign(padded, -1.0f);
+
+    for (int i = 0; i < numSpheres; i++)
+    {
+        center_x[i] = spheres[i].center.x;
+        center_y[i] = spheres[i].center.y;
+        center_z[i] = spheres[i].center.z;
+        radius2[i] = spheres[i].radius * spheres[i].radius;
+    }
+}
+
+int SphereSoA::closestHit(const Ray& ray, int first, int count, float& dst) const
+{
+    return currentKernel(center_x.data(), center_y.data(), center_z.data(), radius2.data(), ray, first, count, dst);
+}
+
+bool SphereSoA::anyHit(const Ray& ray, int first, int count, float maxDst) const
+{
+    return currentAnyKernel(center_x.data(), center_y.data(), center_z.data(), radius2.data(), ray, first, count, maxDst);
+}
@@ -0,0 +1,59 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+#include "ray.h"
+#include "scene.h"
+#include <vector>
+
+// Instruction sets the intersection kernels are built for, slowest first
+enum class SimdLevel
+{
+    Scalar,
+    SSE42,
+    AVX2,
+    AVX512
+};
+
+// Function to get the best level this CPU supports
+SimdLevel detectSimdLevel();
+
+// Function to pick the kernels used from now on. Levels the CPU does not support
+// fall back to the best supported one, which is returned. Defaults to detectSimdLevel().
+SimdLevel setSimdLevel(SimdLevel level);
+SimdLevel getSimdLevel();
+
+const char* simdLevelName(SimdLevel level);
+
+// Function to parse scalar, sse4.2, avx2 or avx512, returns false for anything else
+bool parseSimdLevel(const char* name, SimdLevel& level);
+
+// Structure-of-arrays copy of the sphere positions, so one instruction can test a
+// ray against 4, 8 or 16 spheres. Materials stay in the Sphere array, only the
+// closest hit needs them. The arrays are padded so kernels may read a full
+// vector past the last sphere.
+class SphereSoA
+{
+public:
+    // Function to copy the positions, in the same order as the array
+    void build(const Sphere* spheres, int numSpheres);
+
+    // Function to find the closest of the spheres [first, first + count). Returns
+    // its index, or -1 if nothing is closer than dst. dst is updated with the hit
+    // distance. Gives the same hits as intersectSphere in the same order.
+    int closestHit(const Ray& ray, int first, int count, float& dst) const;
+
+    // Function to check whether any of the spheres [first, first + count) is hit
+    // closer than maxDst. Stops at the first hit it finds.
+    bool anyHit(const Ray& ray, int first, int count, float maxDst) const;
+
+    int size() const { return sphere_count; }
+
+private:
+    std::vector<float> center_x;
+    std::vector<float> center_y;
+    std::vector<float> center_z;
+    std::vector<float> radius2;
+    int sphere_count = 0;
+};
+
+#endif // SPHERE_SOA_H
@@ -0,0 +1,147 @@
+// BVH traversal against testing every sphere. Covers both leaf tests of the CPU
+// walk at every SIMD level, the any-hit query, and the flattened tree the shader
+// walks with miss links, which is replayed here the way the shader does it.
+
+#include "test_common.h"
+#include "bvh.h"
+#include <algorithm>
+
+// Function to get whether the ray enters a node's box before maxDst, the slab
+// test of hit_bounds in the shader
+static bool hitsBounds(const GpuBvhNode& node, const Ray& ray, float maxDst)
+{
+    glm::vec3 invDir = 1.0f / ray.dir;
+    glm::vec3 t0 = (node.bounds_min - ray.origin) * invDir;
+    glm::vec3 t1 = (node.bounds_max - ray.origin) * invDir;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    float entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDst));
+    return entry <= exit;
+}
+
+// Function to walk the flattened tree like the shader: interior nodes that are
+// hit continue with the next node, everything else jumps to its miss index
+static int flatClosestHit(const std::vector<GpuBvhNode>& nodes, const Ray& ray, const Sphere* spheres, float& dst)
+{
+    int closest = -1;
+    int current = nodes.empty() ? -1 : 0;
+    int steps = 0;
+    while (current != -1 && steps++ <= int(nodes.size()))
+    {
+        const GpuBvhNode& node = nodes[current];
+        int next = node.miss_index;
+        if (hitsBounds(node, ray, dst))
+        {
+            int count = node.sphere_range & ((1 << GPU_LEAF_COUNT_BITS) - 1);
+            if (count == 0)
+                next = current + 1;
+            else
+            {
+                int first = node.sphere_range >> GPU_LEAF_COUNT_BITS;
+                int hit = linearClosestHit(ray, spheres, first, count, dst);
+                if (hit >= 0)
+                    closest = hit;
+            }
+        }
+        current = next;
+    }
+    // Every node is visited at most once, more steps mean a miss link loops
+    CHECK(steps <= int(nodes.size()));
+    return closest;
+}
+
+// Function to check one scene: the tree must give the hits of a linear scan
+static void checkScene(std::vector<Sphere> spheres, unsigned int seed)
+{
+    int sphereCount = static_cast<int>(spheres.size());
+
+    Bvh bvh;
+    bvh.build(spheres.data(), sphereCount);
+    CHECK(bvh.nodeCount() > 0);
+    CHECK(bvh.getStats().max_depth <= BVH_STACK_SIZE);
+
+    // Leaves must cover every sphere exactly once
+    std::vector<int> covered(sphereCount, 0);
+    for (int i = 0; i < bvh.nodeCount(); i++)
+    {
+        const BvhNode& node = bvh.getNodes()[i];
+        CHECK(node.count <= BVH_MAX_LEAF_SIZE);
+        for (int s = node.left_first; node.count > 0 && s < node.left_first + node.count; s++)
+            covered[s]++;
+    }
+    CHECK(std::count(covered.begin(), covered.end(), 1) == sphereCount);
+
+    SphereSoA soa;
+    soa.build(spheres.data(), sphereCount);
+    std::vector<GpuBvhNode> flat = bvh.flatten();
+    CHECK(int(flat.size()) == bvh.nodeCount());
+
+    std::vector<Ray> rays = testRays(3000, seed + 1);
+    for (SimdLevel level : supportedSimdLevels())
+    {
+        setSimdLevel(level);
+        int failuresBefore = test_failures;
+        for (const Ray& ray : rays)
+        {
+            float expectedDst = NO_HIT;
+            int expected = linearClosestHit(ray, spheres.data(), 0, sphereCount, expectedDst);
+
+            float dst = NO_HIT;
+            int hit = bvh.closestHit(ray, soa, dst);
+            CHECK(sameHit(hit, dst, expected, expectedDst));
+
+            if (expected >= 0)
+            {
+                CHECK(!bvh.anyHit(ray, soa, expectedDst * 0.999f));
+                CHECK(bvh.anyHit(ray, soa, expectedDst * 1.001f + 1e-3f));
+            }
+            else
+            {
+                CHECK(!bvh.anyHit(ray, soa, NO_HIT));
+            }
+        }
+        if (test_failures != failuresBefore)
+            std::cerr << "Mismatches with " << sphereCount << " spheres at SIMD level " << simdLevelName(level) << std::endl;
+    }
+
+    // The scalar leaf test and the shader's layout do not depend on the SIMD level
+    for (const Ray& ray : rays)
+    {
+        float expectedDst = NO_HIT;
+        int expected = linearClosestHit(ray, spheres.data(), 0, sphereCount, expectedDst);
+
+        float dst = NO_HIT;
+        int hit = bvh.closestHit(ray, spheres.data(), dst);
+        CHECK(sameHit(hit, dst, expected, expectedDst));
+
+        float flatDst = NO_HIT;
+        int flatHit = flatClosestHit(flat, ray, spheres.data(), flatDst);
+        CHECK(sameHit(flatHit, flatDst, expected, expectedDst));
+
+        if (expected >= 0)
+        {
+            CHECK(!bvh.anyHit(ray, spheres.data(), expectedDst * 0.999f));
+            CHECK(bvh.anyHit(ray, spheres.data(), expectedDst * 1.001f + 1e-3f));
+        }
+    }
+}
+
+int main()
+{
+    // The built-in scene, and random ones deep enough for every split path
+    for (int extraSpheres : { 0, 100, 5000 })
+    {
+        std::vector<Sphere> spheres = spheresSetup();
+        addRandomSpheres(spheres, extraSpheres, 2);
+        checkScene(spheres, 3);
+    }
+
+    // Coincident centers leave SAH nothing to split, the build falls back to
+    // object medians
+    std::vector<Sphere> stacked = spheresSetup();
+    for (int i = 0; i < 64; i++)
+        stacked.push_back({ glm::vec3(1.0f, 0.0f, -6.0f), 0.1f + 0.01f * i, glm::vec3(0.5f), 0.0f, glm::vec3(0.0f), 0.0f });
+    checkScene(stacked, 4);
+    return testResult("BVH traversal");
+}
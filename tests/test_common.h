@@ -0,0 +1,100 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+// Small helpers shared by the CPU tests. Every test is its own executable that
+// returns non-zero when a check failed, so CTest needs no framework.
+
+#include "ray.h"
+#include "scene.h"
+#include "sphere_soa.h"
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+static int test_failures = 0;
+
+// Prints the failed condition with its location and keeps going, so one run
+// reports every broken case
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            test_failures++; \
+        } \
+    } while (0)
+
+// Function to end a test, the exit code CTest reads
+inline int testResult(const char* name)
+{
+    if (test_failures > 0)
+        std::cerr << name << ": " << test_failures << " checks failed" << std::endl;
+    else
+        std::cout << name << ": passed" << std::endl;
+    return test_failures > 0 ? 1 : 0;
+}
+
+// Function to get rays from around the scene in every direction. The origins
+// cover the camera position and the inside of the random sphere field.
+inline std::vector<Ray> testRays(int count, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::vector<Ray> rays(count);
+    for (Ray& ray : rays)
+    {
+        ray.origin = glm::vec3(12.0f * unit(rng), 3.0f * unit(rng), -15.0f + 16.0f * unit(rng));
+        glm::vec3 dir;
+        do
+            dir = glm::vec3(unit(rng), unit(rng), unit(rng));
+        while (glm::dot(dir, dir) < 1e-4f || glm::dot(dir, dir) > 1.0f);
+        ray.dir = glm::normalize(dir);
+    }
+    return rays;
+}
+
+// Function to find the closest sphere by testing every one of them, the
+// reference the kernels and the BVH are compared with
+inline int linearClosestHit(const Ray& ray, const Sphere* spheres, int first, int count, float& dst)
+{
+    int closest = -1;
+    for (int i = first; i < first + count; i++)
+    {
+        float t = intersectSphere(ray, spheres[i]);
+        if (t < dst)
+        {
+            dst = t;
+            closest = i;
+        }
+    }
+    return closest;
+}
+
+// Function to compare a hit with the reference. Kernels may round the distance
+// differently, so a different sphere is only accepted at the same distance.
+inline bool sameHit(int index, float dst, int expectedIndex, float expectedDst)
+{
+    if ((index < 0) != (expectedIndex < 0))
+        return false;
+    if (index < 0)
+        return true;
+    float tolerance = 1e-4f * std::max(1.0f, expectedDst);
+    return std::fabs(dst - expectedDst) <= tolerance;
+}
+
+// Function to get every SIMD level this CPU can run, scalar first
+inline std::vector<SimdLevel> supportedSimdLevels()
+{
+    std::vector<SimdLevel> levels;
+    SimdLevel best = detectSimdLevel();
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (level <= best)
+            levels.push_back(level);
+    }
+    return levels;
+}
+
+#endif // TEST_COMMON_H
@@ -0,0 +1,90 @@
+// The A-trous denoiser's SIMD row kernels against the scalar one, on a noisy
+// image with edges in every feature, and the basic promises of the filter: a
+// flat image stays flat, and it runs the same on one thread as on many.
+
+#include "test_common.h"
+#include "denoiser.h"
+#include <algorithm>
+
+// Function to get the largest difference between two images, relative to the
+// brightness of the pixel
+static float maxDifference(const std::vector<glm::vec3>& a, const std::vector<glm::vec3>& b)
+{
+    float largest = 0.0f;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        glm::vec3 d = glm::abs(a[i] - b[i]) / glm::max(glm::max(glm::abs(b[i]), glm::vec3(1.0f)), glm::abs(a[i]));
+        largest = std::max(largest, std::max(d.x, std::max(d.y, d.z)));
+    }
+    return largest;
+}
+
+int main()
+{
+    // Two surfaces split down the middle, and a strip of background, with noise
+    // on top. Widths that are not a multiple of any vector cover the row tails.
+    const int width = 77;
+    const int height = 41;
+    std::vector<glm::vec3> image(size_t(width) * height);
+    DenoiseFeatures features;
+    features.assign(image.size());
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            size_t i = size_t(y) * width + x;
+            bool left = x < width / 2;
+            bool background = y < 5;
+            glm::vec3 base = background ? glm::vec3(0.0f) : (left ? glm::vec3(0.8f, 0.3f, 0.2f) : glm::vec3(0.2f, 0.4f, 0.9f));
+            image[i] = base * (0.5f + unit(rng)) + glm::vec3(unit(rng) < 0.02f ? 20.0f : 0.0f);
+            features.normal[i] = background ? glm::vec3(0.0f) : (left ? glm::vec3(0, 0, 1) : glm::normalize(glm::vec3(1, 0, 1)));
+            features.depth[i] = background ? 0.0f : 3.0f + 0.01f * x;
+            features.albedo[i] = background ? glm::vec3(0.0f) : base;
+            float lum = 0.2126f * image[i].r + 0.7152f * image[i].g + 0.0722f * image[i].b;
+            features.mean_square[i] = lum * lum * (1.0f + unit(rng));
+            features.samples[i] = 1 + int(unit(rng) * 8.0f);
+        }
+    }
+
+    DenoiseSettings settings;
+    ThreadPool pool(4);
+    std::vector<SimdLevel> levels = supportedSimdLevels();
+
+    setSimdLevel(SimdLevel::Scalar);
+    std::vector<glm::vec3> reference;
+    denoiseImage(image, features, width, height, settings, pool, reference);
+    CHECK(reference.size() == image.size());
+    for (const glm::vec3& pixel : reference)
+        CHECK(std::isfinite(pixel.r) && std::isfinite(pixel.g) && std::isfinite(pixel.b));
+
+    // The kernels may only differ by rounding
+    for (SimdLevel level : levels)
+    {
+        setSimdLevel(level);
+        std::vector<glm::vec3> result;
+        denoiseImage(image, features, width, height, settings, pool, result);
+        float difference = maxDifference(result, reference);
+        if (difference > 1e-4f)
+            std::cerr << simdLevelName(level) << " differs from scalar by " << difference << std::endl;
+        CHECK(difference <= 1e-4f);
+
+        // Rows are independent, so the thread count must not change anything
+        ThreadPool single(1);
+        std::vector<glm::vec3> serial;
+        denoiseImage(image, features, width, height, settings, single, serial);
+        CHECK(maxDifference(serial, result) == 0.0f);
+    }
+
+    // A flat image has nothing to smooth
+    std::vector<glm::vec3> flat(image.size(), glm::vec3(0.5f));
+    for (SimdLevel level : levels)
+    {
+        setSimdLevel(level);
+        std::vector<glm::vec3> result;
+        denoiseImage(flat, features, width, height, settings, pool, result);
+        CHECK(maxDifference(result, flat) <= 1e-5f);
+    }
+    return testResult("denoiser kernels");
+}
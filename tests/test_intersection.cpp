@@ -0,0 +1,58 @@
+// The SoA closest-hit and any-hit kernels at every SIMD level the CPU supports,
+// against intersectSphere() on every sphere. Ranges of every length up to a few
+// vectors are tested, so the masked tails of each kernel are covered.
+
+#include "test_common.h"
+#include <algorithm>
+
+int main()
+{
+    std::vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, 200, 11);
+    int sphereCount = static_cast<int>(spheres.size());
+    SphereSoA soa;
+    soa.build(spheres.data(), sphereCount);
+    CHECK(soa.size() == sphereCount);
+
+    std::vector<Ray> rays = testRays(2000, 5);
+    std::mt19937 rng(17);
+
+    for (SimdLevel level : supportedSimdLevels())
+    {
+        CHECK(setSimdLevel(level) == level);
+        int failuresBefore = test_failures;
+
+        for (size_t r = 0; r < rays.size(); r++)
+        {
+            const Ray& ray = rays[r];
+
+            // Short ranges at every length and offset class, then the whole array
+            int count = r + 1 < rays.size() ? int(r % 40) + 1 : sphereCount;
+            int first = count == sphereCount ? 0 : int(rng() % unsigned(sphereCount - count + 1));
+
+            float expectedDst = NO_HIT;
+            int expected = linearClosestHit(ray, spheres.data(), first, count, expectedDst);
+            float dst = NO_HIT;
+            int hit = soa.closestHit(ray, first, count, dst);
+            CHECK(sameHit(hit, dst, expected, expectedDst));
+
+            // A limit below the closest hit hides it, one above keeps it
+            if (expected >= 0)
+            {
+                float below = expectedDst * 0.999f;
+                float limitedDst = below;
+                CHECK(soa.closestHit(ray, first, count, limitedDst) == -1 && limitedDst == below);
+                CHECK(!soa.anyHit(ray, first, count, below));
+                CHECK(soa.anyHit(ray, first, count, expectedDst * 1.001f + 1e-3f));
+            }
+            else
+            {
+                CHECK(!soa.anyHit(ray, first, count, NO_HIT));
+            }
+        }
+
+        if (test_failures != failuresBefore)
+            std::cerr << "Mismatches at SIMD level " << simdLevelName(level) << std::endl;
+    }
+    return testResult("intersection kernels");
+}
@@ -0,0 +1,179 @@
+// Scene files: text conversion, write, map and load must give back the same
+// spheres, camera and trees, the mapped tree must trace like a linear scan, and
+// damaged files must be rejected instead of read. Files go to the working
+// directory, the build directory under CTest.
+
+#include "test_common.h"
+#include "scene_file.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+static std::vector<char> readFile(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const char* path, const std::vector<char>& data)
+{
+    std::ofstream file(path, std::ios::binary);
+    file.write(data.data(), std::streamsize(data.size()));
+}
+
+// Function to check that a scene loaded from a file matches what was written
+static void checkLoaded(const SceneData& scene, const std::vector<Sphere>& spheres, const Camera& camera, const Bvh& bvh)
+{
+    CHECK(scene.sphere_count == int(spheres.size()));
+    CHECK(scene.sphere_count == 0 || std::memcmp(scene.spheres, spheres.data(), spheres.size() * sizeof(Sphere)) == 0);
+    CHECK(std::memcmp(&scene.camera, &camera, sizeof(Camera)) == 0);
+
+    CHECK(scene.bvh.nodeCount() == bvh.nodeCount());
+    CHECK(std::memcmp(scene.bvh.getNodes(), bvh.getNodes(), size_t(bvh.nodeCount()) * sizeof(BvhNode)) == 0);
+    std::vector<GpuBvhNode> flat = bvh.flatten();
+    CHECK(scene.gpu_node_count == int(flat.size()));
+    CHECK(std::memcmp(scene.gpu_nodes, flat.data(), flat.size() * sizeof(GpuBvhNode)) == 0);
+    CHECK(scene.bvh.getStats().max_depth == bvh.getStats().max_depth);
+    CHECK(scene.bvh.getStats().leaf_count == bvh.getStats().leaf_count);
+
+    // The tree read from the mapping must find what every sphere finds
+    for (const Ray& ray : testRays(500, 9))
+    {
+        float expectedDst = NO_HIT;
+        int expected = linearClosestHit(ray, scene.spheres, 0, scene.sphere_count, expectedDst);
+        float dst = NO_HIT;
+        int hit = scene.bvh.closestHit(ray, scene.spheres, dst);
+        CHECK(sameHit(hit, dst, expected, expectedDst));
+    }
+}
+
+// Function to write a damaged copy of a scene file and check it is refused
+static void checkRejected(const std::vector<char>& data, const char* what)
+{
+    const char* path = "test_damaged.rtscene";
+    writeFile(path, data);
+    SceneData scene;
+    if (loadScene(path, 0, true, scene))
+    {
+        std::cerr << "Damaged scene file was loaded: " << what << std::endl;
+        test_failures++;
+    }
+    std::remove(path);
+}
+
+int main()
+{
+    // Write, map and load a random scene with its tree
+    std::vector<Sphere> spheres = spheresSetup();
+    addRandomSpheres(spheres, 300, 21);
+    Camera camera = cameraSetup();
+    camera.focal_length = 1.5f;
+    Bvh bvh;
+    bvh.build(spheres.data(), int(spheres.size()));
+
+    const char* path = "test_scene.rtscene";
+    CHECK(writeSceneFile(path, spheres, camera, &bvh));
+    {
+        SceneFile file;
+        CHECK(file.open(path));
+        CHECK(file.hasBvh());
+        CHECK(file.header().sphere_offset % SCENE_FILE_ALIGNMENT == 0);
+        CHECK(file.header().node_offset % SCENE_FILE_ALIGNMENT == 0);
+        CHECK(file.header().gpu_node_offset % SCENE_FILE_ALIGNMENT == 0);
+    }
+    {
+        SceneData scene;
+        CHECK(loadScene(path, 0, true, scene));
+        // Nothing had to be rebuilt, so the records come straight from the mapping
+        CHECK(scene.owned_spheres.empty() && scene.owned_gpu_nodes.empty());
+        checkLoaded(scene, spheres, camera, bvh);
+    }
+    {
+        // Added spheres copy the file and build a new tree over all of them
+        SceneData scene;
+        CHECK(loadScene(path, 10, true, scene));
+        CHECK(scene.sphere_count == int(spheres.size()) + 10);
+        CHECK(scene.bvh.nodeCount() > 0 && scene.gpu_node_count == scene.bvh.nodeCount());
+    }
+
+    // A file without a tree gets one built when it is needed
+    const char* flatPath = "test_scene_no_bvh.rtscene";
+    CHECK(writeSceneFile(flatPath, spheres, camera, nullptr));
+    {
+        SceneData scene;
+        CHECK(loadScene(flatPath, 0, false, scene));
+        CHECK(scene.sphere_count == int(spheres.size()) && scene.bvh.nodeCount() == 0);
+        CHECK(loadScene(flatPath, 0, true, scene));
+        CHECK(scene.bvh.nodeCount() > 0);
+    }
+    std::remove(flatPath);
+
+    // Text scenes convert to files that load back in leaf order
+    const char* textPath = "test_scene.txt";
+    const char* convertedPath = "test_converted.rtscene";
+    {
+        std::ofstream text(textPath);
+        text << "# two spheres and a camera\n"
+             << "camera 0 1 2 1.25 2\n"
+             << "sphere 0 0 -5 1   0.8 0.2 0.2 0   0 0 0 0\n"
+             << "sphere 2 0 -6 0.5 0.2 0.8 0.2 4   1 1 1 0.5\n";
+    }
+    CHECK(convertSceneText(textPath, convertedPath));
+    {
+        std::vector<Sphere> textSpheres;
+        Camera textCamera;
+        CHECK(loadSceneText(textPath, textSpheres, textCamera));
+        CHECK(textSpheres.size() == 2 && textCamera.focal_length == 1.25f);
+        Bvh textBvh;
+        textBvh.build(textSpheres.data(), int(textSpheres.size()));
+
+        SceneData scene;
+        CHECK(loadScene(convertedPath, 0, true, scene));
+        checkLoaded(scene, textSpheres, textCamera, textBvh);
+    }
+    std::remove(textPath);
+    std::remove(convertedPath);
+
+    // Damaged copies must be refused before their records are used
+    std::vector<char> good = readFile(path);
+    SceneFileHeader header;
+    std::memcpy(&header, good.data(), sizeof(header));
+    auto node = [&](std::vector<char>& data, int i) { return reinterpret_cast<BvhNode*>(data.data() + header.node_offset) + i; };
+    auto gpuNode = [&](std::vector<char>& data, int i) { return reinterpret_cast<GpuBvhNode*>(data.data() + header.gpu_node_offset) + i; };
+    auto firstLeaf = [&](std::vector<char>& data)
+    {
+        int i = 0;
+        while (node(data, i)->count == 0)
+            i++;
+        return i;
+    };
+
+    std::vector<char> damaged(good.begin(), good.end() - 1);
+    checkRejected(damaged, "truncated");
+    damaged = good;
+    reinterpret_cast<SceneFileHeader*>(damaged.data())->sphere_offset = ~uint64_t(SCENE_FILE_ALIGNMENT - 1);
+    checkRejected(damaged, "sphere offset that wraps around");
+    damaged = good;
+    node(damaged, 0)->left_first = header.node_count;
+    checkRejected(damaged, "child past the node section");
+    damaged = good;
+    node(damaged, 2)->count = 0;
+    node(damaged, 2)->left_first = 1;
+    checkRejected(damaged, "child before its parent");
+    damaged = good;
+    node(damaged, firstLeaf(damaged))->left_first = int(spheres.size());
+    checkRejected(damaged, "leaf past the spheres");
+    damaged = good;
+    node(damaged, firstLeaf(damaged))->count = BVH_MAX_LEAF_SIZE + 1;
+    checkRejected(damaged, "oversized leaf");
+    damaged = good;
+    gpuNode(damaged, 3)->miss_index = 1;
+    checkRejected(damaged, "backwards miss link");
+    damaged = good;
+    reinterpret_cast<SceneFileHeader*>(damaged.data())->version = SCENE_FILE_VERSION + 1;
+    checkRejected(damaged, "unknown version");
+
+    std::remove(path);
+    return testResult("scene file round trip");
+}
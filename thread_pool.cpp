@@ -0,0 +1,80 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+    if (numThreads == 0)
+        numThreads = std::thread::hardware_concurrency();
+    if (numThreads == 0)
+        numThreads = 1;
+
+    // The caller of run() is the last thread
+    for (unsigned int i = 1; i < numThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+unsigned int ThreadPool::size() const
+{
+    return static_cast<unsigned int>(workers.size()) + 1;
+}
+
+void ThreadPool::run(int taskCount, const std::function<void(int)>& task)
+{
+    if (taskCount <= 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        currentTask = &task;
+        currentTaskCount = taskCount;
+        nextTask = 0;
+        activeWorkers = static_cast<unsigned int>(workers.size());
+        generation++;
+    }
+    wakeCondition.notify_all();
+
+    drainTasks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return activeWorkers == 0; });
+    currentTask = nullptr;
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned int seenGeneration = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping)
+                return;
+            seenGeneration = generation;
+        }
+
+        drainTasks();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--activeWorkers == 0)
+            doneCondition.notify_one();
+    }
+}
+
+void ThreadPool::drainTasks()
+{
+    for (int i = nextTask++; i < currentTaskCount; i = nextTask++)
+        (*currentTask)(i);
+}
@@ -0,0 +1,47 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads. The calling thread also takes part in run(),
+// so a pool of N threads keeps N cores busy.
+class ThreadPool
+{
+public:
+    // numThreads = 0 uses every hardware thread
+    explicit ThreadPool(unsigned int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Function to get the number of threads taking part in run()
+    unsigned int size() const;
+
+    // Function to call task(i) for every i in [0, taskCount) and wait for all of them.
+    // Tasks are handed out one at a time, so uneven tasks balance themselves.
+    void run(int taskCount, const std::function<void(int)>& task);
+
+private:
+    void workerLoop();
+    void drainTasks();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::condition_variable doneCondition;
+
+    const std::function<void(int)>* currentTask = nullptr;
+    int currentTaskCount = 0;
+    std::atomic<int> nextTask{ 0 };
+    unsigned int generation = 0;
+    unsigned int activeWorkers = 0;
+    bool stopping = false;
+};
+
+#endif // THREAD_POOL_H
@@ -1,7 +1,8 @@
 #version 330 core
-layout(location = 0) in vec2 aPos;
-out vec2 texCoord;
+// One triangle that covers the whole screen, corners at (-1, -1), (3, -1) and
+// (-1, 3). It needs no vertex buffer, and unlike a two-triangle quad no pixels
+// along a diagonal are shaded twice.
 void main() {
-    texCoord = (aPos + 1.0) / 2.0;
-    gl_Position = vec4(aPos, 0.0, 1.0);
+    vec2 position = vec2(float((gl_VertexID & 1) << 2) - 1.0, float((gl_VertexID & 2) << 1) - 1.0);
+    gl_Position = vec4(position, 0.0, 1.0);
 }